@@ -4,18 +4,36 @@
 #include <string>
 #include <vector>
 #include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <algorithm>
-#include <sstream>
-#include <unordered_map>
+#include <charconv>
+#include <system_error>
+#include <cstdlib>
 #include <array>
+#include <map>
+#include <memory>
+#include <string_view>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <climits>
+#include <cctype>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <omp.h>
 #include <libxl.h>
 
 using namespace libxl;
 
-struct Bloque {
-    std::vector<std::string> lineas;
-};
-
 struct Fecha {
     int anio;
     int mes;
@@ -29,491 +47,2977 @@ struct Fecha {
 struct RegistroCompra {
     Fecha fecha;
     int numeroTienda;
-    std::string identificadorProducto;
-    std::string nombre;
-    int cantidad;
-    double monto;
+    std::string_view identificadorProducto; // Vista a la línea o a la arena del bloque
+    std::string_view nombre;
+    int64_t cantidad;
+    double monto = 0.0;
+    int64_t montoFijo = 0; // Monto en unidades de ESCALA_MONEDA, sólo en modo de punto fijo
+    size_t hashProducto; // Se calcula una vez al convertir y sirve para todas las búsquedas
+};
+
+// Resultado de convertir un registro; los errores se informan sin excepciones
+enum class EstadoRegistro {
+    Correcto,
+    CamposInsuficientes,
+    FechaInvalida,
+    ErrorConversion,
+    FueraDeRango
+};
+
+// Campos de una línea como vistas a la propia línea. Se reutiliza entre líneas,
+// así que separar un registro no reserva memoria.
+const size_t MAX_CAMPOS = 32;
+
+struct Campos {
+    std::array<std::string_view, MAX_CAMPOS> vistas;
+    size_t cantidad = 0;
+
+    void limpiar() {
+        cantidad = 0;
+    }
+
+    // Los campos por encima de MAX_CAMPOS se descartan, ningún registro los usa
+    void agregar(std::string_view campo) {
+        if (cantidad < MAX_CAMPOS) {
+            vistas[cantidad++] = campo;
+        }
+    }
+
+    size_t size() const {
+        return cantidad;
+    }
+
+    std::string_view operator[](size_t i) const {
+        return vistas[i];
+    }
+};
+
+// Arena temporal de un bloque para los campos que no son contiguos en la línea
+// (por ejemplo los que cruzan el salto de un registro unido). Las vistas que
+// entrega son válidas mientras viva la arena.
+class ArenaTemporal {
+private:
+    static constexpr size_t TAMANO_TROZO = 64 * 1024;
+    std::vector<std::pair<std::unique_ptr<char[]>, size_t>> trozos; // Memoria y capacidad
+    size_t trozoActual;
+    size_t usado; // Bytes ocupados en el trozo actual
+
+public:
+    std::string temporal; // Búfer reutilizable para armar un campo antes de copiarlo
+
+    ArenaTemporal() : trozoActual(0), usado(0) {}
+
+    std::string_view copiar(std::string_view texto) {
+        while (trozoActual < trozos.size() && usado + texto.size() > trozos[trozoActual].second) {
+            ++trozoActual;
+            usado = 0;
+        }
+        if (trozoActual == trozos.size()) {
+            size_t capacidad = std::max(TAMANO_TROZO, texto.size());
+            trozos.emplace_back(std::make_unique<char[]>(capacidad), capacidad);
+            usado = 0;
+        }
+        char* destino = trozos[trozoActual].first.get() + usado;
+        std::memcpy(destino, texto.data(), texto.size());
+        usado += texto.size();
+        return std::string_view(destino, texto.size());
+    }
+
+    // Descarta el contenido conservando los trozos para volver a llenarlos
+    void reiniciar() {
+        trozoActual = 0;
+        usado = 0;
+    }
+};
+
+struct Bloque {
+    size_t numero = 0; // Posición del bloque dentro del archivo, fija el orden de acumulación
+    std::string_view rango; // Registros completos en el mapeo, aún sin separar en líneas
+    std::vector<std::string_view> lineas; // Vistas a cada registro, en el mapeo o en datos
+    std::vector<char> datos; // Almacenamiento propio cuando el archivo no está mapeado
+    std::vector<RegistroCompra> registros; // Registros ya convertidos, con vistas a las líneas o a arena
+    std::vector<EstadoRegistro> errores; // Errores de conversión, en el orden de las líneas
+    std::vector<int32_t> mesesErrores; // mesDelPrefijo de la línea de cada error, para filtrarlos desde la caché
+    ArenaTemporal arena;
+    // Con filtro de fechas: meses del primer y último registro según el prefijo
+    // de la línea, y si todos los prefijos se pudieron leer y venían en orden
+    int primerMes = -1;
+    int ultimoMes = -1;
+    bool enOrden = true;
+
+    Bloque() = default;
+    Bloque(Bloque&&) = default;
+    Bloque& operator=(Bloque&&) = default;
+    // Las vistas apuntan a datos, una copia quedaría apuntando al bloque original
+    Bloque(const Bloque&) = delete;
+    Bloque& operator=(const Bloque&) = delete;
+
+    // Deja el bloque vacío para reutilizarlo; los vectores y la arena conservan su memoria
+    void reiniciar() {
+        numero = 0;
+        rango = std::string_view();
+        lineas.clear();
+        datos.clear();
+        registros.clear();
+        errores.clear();
+        mesesErrores.clear();
+        arena.reiniciar();
+        primerMes = ultimoMes = -1;
+        enOrden = true;
+    }
+};
+
+using BloquePtr = std::unique_ptr<Bloque>;
+
+// Espera activa breve que luego cede el procesador y finalmente duerme, para
+// no gastar un núcleo mientras la otra etapa tarda.
+class Espera {
+private:
+    int intentos = 0;
+
+public:
+    void operator()() {
+        ++intentos;
+        if (intentos < 16) {
+#if defined(__x86_64__) || defined(__i386__)
+            _mm_pause();
+#endif
+        } else if (intentos < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+};
+
+// Cola acotada sin bloqueos (anillo MPMC de D. Vyukov) de punteros a bloques
+// entre el hilo lector y los de procesamiento. Cada celda lleva un número de
+// secuencia que indica si está libre para escribir o lista para leer, y las
+// posiciones de escritura y lectura se reservan con compare_exchange. push
+// espera mientras la cola está llena, de modo que el lector nunca se adelanta
+// más de "capacidad" bloques (profundidad de lectura anticipada). Con una sola
+// celda los números de secuencia de "llena" y "libre" coinciden, por eso la
+// capacidad mínima es 2.
+class Cola {
+private:
+    struct Celda {
+        std::atomic<size_t> secuencia;
+        BloquePtr bloque;
+    };
+
+    std::unique_ptr<Celda[]> celdas;
+    size_t capacidad;
+    alignas(64) std::atomic<size_t> posicionEscritura;
+    alignas(64) std::atomic<size_t> posicionLectura;
+    std::atomic<bool> cerrada;
+
+public:
+    explicit Cola(size_t capacidad)
+        : celdas(new Celda[std::max<size_t>(capacidad, 2)]), capacidad(std::max<size_t>(capacidad, 2)),
+          posicionEscritura(0), posicionLectura(0), cerrada(false) {
+        for (size_t i = 0; i < this->capacidad; ++i) {
+            celdas[i].secuencia.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Intenta encolar sin esperar; si la cola está llena devuelve false y el bloque queda en el llamador
+    bool intentarPush(BloquePtr& bloque) {
+        size_t posicion = posicionEscritura.load(std::memory_order_relaxed);
+        for (;;) {
+            Celda& celda = celdas[posicion % capacidad];
+            size_t secuencia = celda.secuencia.load(std::memory_order_acquire);
+            intptr_t diferencia = static_cast<intptr_t>(secuencia) - static_cast<intptr_t>(posicion);
+            if (diferencia == 0) {
+                if (posicionEscritura.compare_exchange_weak(posicion, posicion + 1, std::memory_order_relaxed)) {
+                    celda.bloque = std::move(bloque);
+                    celda.secuencia.store(posicion + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diferencia < 0) {
+                return false;
+            } else {
+                posicion = posicionEscritura.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Intenta desencolar sin esperar; devuelve false si la cola está vacía
+    bool intentarPop(BloquePtr& bloque) {
+        size_t posicion = posicionLectura.load(std::memory_order_relaxed);
+        for (;;) {
+            Celda& celda = celdas[posicion % capacidad];
+            size_t secuencia = celda.secuencia.load(std::memory_order_acquire);
+            intptr_t diferencia = static_cast<intptr_t>(secuencia) - static_cast<intptr_t>(posicion + 1);
+            if (diferencia == 0) {
+                if (posicionLectura.compare_exchange_weak(posicion, posicion + 1, std::memory_order_relaxed)) {
+                    bloque = std::move(celda.bloque);
+                    celda.secuencia.store(posicion + capacidad, std::memory_order_release);
+                    return true;
+                }
+            } else if (diferencia < 0) {
+                return false;
+            } else {
+                posicion = posicionLectura.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void push(BloquePtr&& bloque) {
+        Espera espera;
+        while (!intentarPush(bloque)) {
+            espera();
+        }
+    }
+
+    // Espera hasta que haya un bloque; devuelve false si la cola se cerró y está vacía
+    bool pop(BloquePtr& bloque) {
+        Espera espera;
+        for (;;) {
+            if (intentarPop(bloque)) {
+                return true;
+            }
+            if (cerrada.load(std::memory_order_acquire)) {
+                return intentarPop(bloque); // Pudo llegar un bloque justo antes del cierre
+            }
+            espera();
+        }
+    }
+
+    // Indica que no se agregarán más bloques
+    void cerrar() {
+        cerrada.store(true, std::memory_order_release);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Cantidad aproximada mientras otros hilos la modifican
+    size_t size() const {
+        size_t escritura = posicionEscritura.load(std::memory_order_acquire);
+        size_t lectura = posicionLectura.load(std::memory_order_acquire);
+        return escritura > lectura ? escritura - lectura : 0;
+    }
+};
+
+size_t hashIdentificador(std::string_view id) {
+    return std::hash<std::string_view>()(id);
+}
+
+// Tabla de dispersión con direccionamiento abierto (Robin Hood) que guarda
+// índices a un vector denso del dueño. Cada ranura ocupa 8 bytes: 32 bits del
+// hash, que también dan la ranura ideal, y el índice. La comparación de claves
+// la hace el dueño, con el predicado que pasa a buscar.
+class TablaDispersion {
+public:
+    static constexpr uint32_t VACIA = UINT32_MAX;
+
+private:
+    struct Ranura {
+        uint32_t fragmento;
+        uint32_t indice; // VACIA si la ranura está libre
+    };
+
+    static constexpr size_t CAPACIDAD_INICIAL = 64;
+
+    std::vector<Ranura> ranuras;
+    size_t mascara = 0;
+
+    // Distancia de una ranura ocupada a su ranura ideal
+    size_t distancia(const Ranura& ranura, size_t posicion) const {
+        return (posicion - (ranura.fragmento & mascara)) & mascara;
+    }
+
+    void colocar(Ranura nueva) {
+        size_t posicion = nueva.fragmento & mascara;
+        size_t recorrido = 0;
+        for (;;) {
+            Ranura& ranura = ranuras[posicion];
+            if (ranura.indice == VACIA) {
+                ranura = nueva;
+                return;
+            }
+            // La entrada más lejos de su ranura ideal se queda el lugar
+            size_t distanciaRanura = distancia(ranura, posicion);
+            if (distanciaRanura < recorrido) {
+                std::swap(ranura, nueva);
+                recorrido = distanciaRanura;
+            }
+            posicion = (posicion + 1) & mascara;
+            ++recorrido;
+        }
+    }
+
+public:
+    // Índice cuya clave cumple "igual", o VACIA
+    template <typename Igual>
+    uint32_t buscar(size_t hash, Igual igual) const {
+        if (ranuras.empty()) {
+            return VACIA;
+        }
+        uint32_t fragmento = static_cast<uint32_t>(hash);
+        size_t posicion = fragmento & mascara;
+        for (size_t recorrido = 0;; ++recorrido) {
+            const Ranura& ranura = ranuras[posicion];
+            // Una ranura vacía o más cercana a su ideal que lo recorrido corta la búsqueda
+            if (ranura.indice == VACIA || distancia(ranura, posicion) < recorrido) {
+                return VACIA;
+            }
+            if (ranura.fragmento == fragmento && igual(ranura.indice)) {
+                return ranura.indice;
+            }
+            posicion = (posicion + 1) & mascara;
+        }
+    }
+
+    // Duplica la tabla si "cantidad" índices superarían un factor de carga de
+    // 7/8; los índices 0..cantidad-2 se recolocan con su hash
+    template <typename HashDe>
+    void reservar(size_t cantidad, HashDe hashDe) {
+        if (cantidad * 8 <= ranuras.size() * 7) {
+            return;
+        }
+        ranuras.assign(ranuras.empty() ? CAPACIDAD_INICIAL : ranuras.size() * 2, Ranura{ 0, VACIA });
+        mascara = ranuras.size() - 1;
+        for (uint32_t i = 0; i + 1 < cantidad; ++i) {
+            colocar(Ranura{ static_cast<uint32_t>(hashDe(i)), i });
+        }
+    }
+
+    // El llamador garantiza que la clave no está y que hay lugar (reservar)
+    void insertar(size_t hash, uint32_t indice) {
+        colocar(Ranura{ static_cast<uint32_t>(hash), indice });
+    }
+
+    void limpiar() {
+        std::fill(ranuras.begin(), ranuras.end(), Ranura{ 0, VACIA });
+    }
+};
+
+// Símbolo de un texto internado: dos textos iguales tienen el mismo símbolo
+using Simbolo = uint32_t;
+
+// Los símbolos son consecutivos; se mezclan para repartirlos en una tabla
+size_t hashSimbolo(Simbolo simbolo) {
+    uint64_t h = simbolo * 0x9E3779B97F4A7C15ull;
+    return static_cast<size_t>(h ^ (h >> 32));
+}
+
+// Pool de textos internados. Los bytes se copian una sola vez a una arena que
+// sólo crece y cada texto distinto recibe un símbolo consecutivo de 32 bits,
+// así que productos, nombres y canastas guardan y comparan enteros.
+class PoolSimbolos {
+private:
+    struct Entrada {
+        std::string_view texto; // Vista a la arena
+        size_t hash;
+    };
+
+    ArenaTemporal arena;
+    std::vector<Entrada> entradas;
+    TablaDispersion tabla;
+
+public:
+    Simbolo internar(std::string_view texto, size_t hash) {
+        uint32_t simbolo = tabla.buscar(hash, [&](uint32_t i) { return entradas[i].texto == texto; });
+        if (simbolo != TablaDispersion::VACIA) {
+            return simbolo;
+        }
+        tabla.reservar(entradas.size() + 1, [&](uint32_t i) { return entradas[i].hash; });
+        entradas.push_back(Entrada{ arena.copiar(texto), hash });
+        tabla.insertar(hash, static_cast<Simbolo>(entradas.size() - 1));
+        return static_cast<Simbolo>(entradas.size() - 1);
+    }
+
+    Simbolo internar(std::string_view texto) {
+        return internar(texto, hashIdentificador(texto));
+    }
+
+    std::string_view texto(Simbolo simbolo) const {
+        return entradas[simbolo].texto;
+    }
+
+    size_t hash(Simbolo simbolo) const {
+        return entradas[simbolo].hash;
+    }
+
+    size_t size() const {
+        return entradas.size();
+    }
+
+    // Olvida todos los símbolos conservando la memoria, para reutilizar el pool entre bloques
+    void clear() {
+        entradas.clear();
+        tabla.limpiar();
+        arena.reiniciar();
+    }
+};
+
+// Años aceptados en las fechas; acotan el ancho del cubo de ventas
+const int ANIO_MINIMO = 1900;
+const int ANIO_MAXIMO = 2100;
+
+// Unidades menores por unidad monetaria en el modo de punto fijo (centésimos)
+const int64_t ESCALA_MONEDA = 100;
+const int DECIMALES_MONEDA = 2; // Dígitos de ESCALA_MONEDA menos uno
+
+// Cómo se agregan las ventas, según las opciones de la línea de comandos
+struct OpcionesAgregacion {
+    bool puntoFijo = false; // Montos como enteros de ESCALA_MONEDA en vez de double
+    bool porTienda = false; // Además, ventas por producto y tienda
+    bool diario = false;    // Además, ventas por producto y día del año
+    int mesDesde = 0;       // Sólo registros entre estos meses, como anio * 12 + mes - 1
+    int mesHasta = INT_MAX;
+
+    bool filtraFechas() const { return mesDesde > 0 || mesHasta < INT_MAX; }
+    bool admiteMes(int mes) const { return mes >= mesDesde && mes <= mesHasta; }
+};
+
+// El día del año se cuenta siempre con 29 de febrero, así cada fecha cae en el
+// mismo lugar todos los años; en los años comunes ese lugar queda vacío.
+const int DIAS_POR_ANIO = 366;
+const int DIAS_ANTES_DEL_MES[12] = { 0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335 };
+const int DIAS_DEL_MES[12] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+const int SEMANAS_POR_ANIO = 53;
+
+inline bool esBisiesto(int anio) {
+    return (anio % 4 == 0 && anio % 100 != 0) || anio % 400 == 0;
+}
+
+inline int diaDelAnio(int mes, int dia) {
+    return DIAS_ANTES_DEL_MES[mes - 1] + dia - 1;
+}
+
+inline int mesDelDia(int diaAnio) {
+    return static_cast<int>(std::upper_bound(DIAS_ANTES_DEL_MES, DIAS_ANTES_DEL_MES + 12, diaAnio) - DIAS_ANTES_DEL_MES) - 1;
+}
+
+// Semana (0 a 52) contada desde el 1 de enero del año real
+inline int semanaDelDia(int anio, int diaAnio) {
+    int diaReal = (!esBisiesto(anio) && diaAnio > DIAS_ANTES_DEL_MES[2] - 1) ? diaAnio - 1 : diaAnio;
+    return diaReal / 7;
+}
+
+// Escritura y lectura binaria del estado guardado entre ejecuciones, en el
+// orden de bytes de la máquina. Los vectores se leen por partes, así un largo
+// dañado termina en un error de lectura y no en una reserva enorme.
+template <typename T>
+void escribirValor(std::ostream& salida, const T& valor) {
+    salida.write(reinterpret_cast<const char*>(&valor), sizeof(T));
+}
+
+template <typename T>
+bool leerValor(std::istream& entrada, T& valor) {
+    return static_cast<bool>(entrada.read(reinterpret_cast<char*>(&valor), sizeof(T)));
+}
+
+template <typename T>
+void escribirVector(std::ostream& salida, const std::vector<T>& valores) {
+    escribirValor(salida, uint64_t(valores.size()));
+    salida.write(reinterpret_cast<const char*>(valores.data()), valores.size() * sizeof(T));
+}
+
+template <typename T>
+bool leerVector(std::istream& entrada, std::vector<T>& valores) {
+    uint64_t cantidad;
+    if (!leerValor(entrada, cantidad)) {
+        return false;
+    }
+    valores.clear();
+    while (cantidad > 0) {
+        size_t parte = std::min<uint64_t>(cantidad, 64 * 1024);
+        size_t anterior = valores.size();
+        valores.resize(anterior + parte);
+        if (!entrada.read(reinterpret_cast<char*>(&valores[anterior]), parte * sizeof(T))) {
+            return false;
+        }
+        cantidad -= parte;
+    }
+    return true;
+}
+
+// Cubo denso de ventas en columnas: montos y cantidades contiguos indexados por
+// [producto][anio - anioBase][periodo], y una máscara de bits por producto y
+// año con los periodos que tuvieron ventas. Los periodos son los 12 meses, o
+// los 366 días del año en las ventas diarias. El rango de años crece según llegan
+// registros; al ampliarse se reubican las filas, cosa que ocurre pocas veces.
+// En modo de punto fijo los montos se suman como enteros de ESCALA_MONEDA,
+// exactos y asociativos, en lugar de double; sólo se usa una de las columnas.
+class CuboVentas {
+private:
+    bool puntoFijo;
+    int periodos; // Periodos por año
+    int palabras; // Palabras de 64 bits de la máscara de un producto y año
+    int anioBase = 0;
+    int cantidadAnios = 0;
+    size_t cantidadProductos = 0;
+    std::vector<double> montos; // Vacía en modo de punto fijo
+    std::vector<int64_t> montosFijos; // Sólo en modo de punto fijo
+    std::vector<int64_t> cantidades;
+    std::vector<uint64_t> mascaras; // "palabras" por producto y año; bit p = periodo p con ventas
+
+    // Pasa una columna al nuevo rango de años, que siempre contiene al anterior.
+    // Se hace en el lugar, del último producto al primero (cada uno sólo se
+    // corre hacia adelante), así la columna conserva su memoria entre bloques;
+    // porAnio es periodos o palabras
+    template <typename T>
+    void reubicarColumna(std::vector<T>& columna, size_t porAnio, int nuevaCantidad, int corrimiento) {
+        columna.resize(cantidadProductos * nuevaCantidad * porAnio, T());
+        size_t viejo = cantidadAnios * porAnio;
+        size_t nuevo = nuevaCantidad * porAnio;
+        size_t antes = corrimiento * porAnio;
+        for (size_t producto = cantidadProductos; producto-- > 0;) {
+            T* origen = columna.data() + producto * viejo;
+            T* destino = columna.data() + producto * nuevo;
+            if (destino + antes != origen) {
+                std::memmove(destino + antes, origen, viejo * sizeof(T));
+            }
+            std::fill(destino, destino + antes, T());
+            std::fill(destino + antes + viejo, destino + nuevo, T());
+        }
+    }
+
+    void reubicar(int nuevoBase, int nuevaCantidad) {
+        int corrimiento = cantidadAnios == 0 ? 0 : anioBase - nuevoBase; // Sin años aún no hay nada que correr
+        if (puntoFijo) {
+            reubicarColumna(montosFijos, periodos, nuevaCantidad, corrimiento);
+        } else {
+            reubicarColumna(montos, periodos, nuevaCantidad, corrimiento);
+        }
+        reubicarColumna(cantidades, periodos, nuevaCantidad, corrimiento);
+        reubicarColumna(mascaras, palabras, nuevaCantidad, corrimiento);
+        anioBase = nuevoBase;
+        cantidadAnios = nuevaCantidad;
+    }
+
+    size_t fila(size_t producto, int desplazamiento) const {
+        return producto * cantidadAnios + desplazamiento;
+    }
+
+public:
+    static constexpr uint64_t TODOS_LOS_MESES = 0xFFF;
+
+    explicit CuboVentas(bool puntoFijo = false, int periodos = 12)
+        : puntoFijo(puntoFijo), periodos(periodos), palabras((periodos + 63) / 64) {}
+
+    int primerAnio() const { return anioBase; }
+    int anios() const { return cantidadAnios; }
+    int periodosPorAnio() const { return periodos; }
+    size_t filas() const { return cantidadProductos; }
+    bool enPuntoFijo() const { return puntoFijo; }
+
+    // Desplazamiento del año en el cubo, ampliando el rango si hace falta
+    int asegurarAnio(int anio) {
+        if (cantidadAnios == 0) {
+            reubicar(anio, 1);
+        } else if (anio < anioBase) {
+            reubicar(anio, cantidadAnios + (anioBase - anio));
+        } else if (anio >= anioBase + cantidadAnios) {
+            reubicar(anioBase, anio - anioBase + 1);
+        }
+        return anio - anioBase;
+    }
+
+    // Agrega una fila en cero para un producto nuevo
+    void agregarProducto() {
+        ++cantidadProductos;
+        if (puntoFijo) {
+            montosFijos.resize(cantidadProductos * cantidadAnios * periodos, 0);
+        } else {
+            montos.resize(cantidadProductos * cantidadAnios * periodos, 0.0);
+        }
+        cantidades.resize(cantidadProductos * cantidadAnios * periodos, 0);
+        mascaras.resize(cantidadProductos * cantidadAnios * palabras, 0);
+    }
+
+    // Suma una venta; de los dos montos se usa el del modo del cubo
+    void sumar(size_t producto, int anio, int periodo, double monto, int64_t montoFijo, int64_t cantidad) {
+        size_t f = fila(producto, asegurarAnio(anio)); // asegurarAnio antes de usar cantidadAnios
+        size_t celda = f * periodos + periodo;
+        if (puntoFijo) {
+            montosFijos[celda] += montoFijo;
+        } else {
+            montos[celda] += monto;
+        }
+        cantidades[celda] += cantidad;
+        mascaras[f * palabras + periodo / 64] |= uint64_t(1) << (periodo % 64);
+    }
+
+    // Máscara de un producto y año en los cubos de hasta 64 periodos (el mensual)
+    uint64_t mascara(size_t producto, int desplazamiento) const {
+        return mascaras[fila(producto, desplazamiento) * palabras];
+    }
+
+    bool conVentas(size_t producto, int desplazamiento, int periodo) const {
+        return (mascaras[fila(producto, desplazamiento) * palabras + periodo / 64] >> (periodo % 64)) & 1;
+    }
+
+    bool anioConVentas(size_t producto, int desplazamiento) const {
+        const uint64_t* m = &mascaras[fila(producto, desplazamiento) * palabras];
+        return std::any_of(m, m + palabras, [](uint64_t palabra) { return palabra != 0; });
+    }
+
+    // Monto acumulado de un periodo en unidades monetarias, en cualquiera de los dos modos
+    double monto(size_t producto, int desplazamiento, int periodo) const {
+        size_t celda = fila(producto, desplazamiento) * periodos + periodo;
+        if (puntoFijo) {
+            return static_cast<double>(montosFijos[celda]) / ESCALA_MONEDA;
+        }
+        return montos[celda];
+    }
+
+    // Los periodos de un producto y año, contiguos
+    const int64_t* cantidadesDe(size_t producto, int desplazamiento) const {
+        return &cantidades[fila(producto, desplazamiento) * periodos];
+    }
+
+    // Suma un año de un producto de otro cubo del mismo modo y periodos en el año "anio" de destino
+    void sumarAnio(size_t destino, int anio, const CuboVentas& origen, size_t producto, int desplazamiento) {
+        size_t f = fila(destino, asegurarAnio(anio));
+        size_t filaOrigen = origen.fila(producto, desplazamiento);
+        if (puntoFijo) {
+            for (int p = 0; p < periodos; ++p) {
+                montosFijos[f * periodos + p] += origen.montosFijos[filaOrigen * periodos + p];
+            }
+        } else {
+            for (int p = 0; p < periodos; ++p) {
+                montos[f * periodos + p] += origen.montos[filaOrigen * periodos + p];
+            }
+        }
+        for (int p = 0; p < periodos; ++p) {
+            cantidades[f * periodos + p] += origen.cantidades[filaOrigen * periodos + p];
+        }
+        for (int w = 0; w < palabras; ++w) {
+            mascaras[f * palabras + w] |= origen.mascaras[filaOrigen * palabras + w];
+        }
+    }
+
+    // Suma la fila de un producto de otro cubo del mismo modo y periodos, con sus propios años
+    void sumarFila(size_t destino, const CuboVentas& origen, size_t producto) {
+        for (int desplazamiento = 0; desplazamiento < origen.anios(); ++desplazamiento) {
+            if (origen.anioConVentas(producto, desplazamiento)) {
+                sumarAnio(destino, origen.primerAnio() + desplazamiento, origen, producto, desplazamiento);
+            }
+        }
+    }
+
+    // Suma un año de un producto de otro cubo del mismo modo en el año "anio"
+    // de destino agrupando sus periodos: grupo(anio, periodo) da el periodo de
+    // este cubo, o -1 para omitirlo
+    template <typename Grupo>
+    void sumarAgrupado(size_t destino, int anio, const CuboVentas& origen, size_t producto, int desplazamiento, Grupo grupo) {
+        size_t filaOrigen = origen.fila(producto, desplazamiento);
+        for (int p = 0; p < origen.periodos; ++p) {
+            int g = origen.conVentas(producto, desplazamiento, p) ? grupo(anio, p) : -1;
+            if (g < 0) {
+                continue;
+            }
+            size_t celda = filaOrigen * origen.periodos + p;
+            sumar(destino, anio, g, puntoFijo ? 0.0 : origen.montos[celda], puntoFijo ? origen.montosFijos[celda] : 0,
+                  origen.cantidades[celda]);
+        }
+    }
+
+    // Quita todos los productos y años; conserva la memoria para el siguiente
+    // bloque, que sólo abarcará los años de sus propios registros
+    void limpiar() {
+        cantidadProductos = 0;
+        anioBase = 0;
+        cantidadAnios = 0;
+        montos.clear();
+        montosFijos.clear();
+        cantidades.clear();
+        mascaras.clear();
+    }
+
+    void guardar(std::ostream& salida) const {
+        escribirValor(salida, int32_t(anioBase));
+        escribirValor(salida, int32_t(cantidadAnios));
+        escribirValor(salida, uint64_t(cantidadProductos));
+        if (puntoFijo) {
+            escribirVector(salida, montosFijos);
+        } else {
+            escribirVector(salida, montos);
+        }
+        escribirVector(salida, cantidades);
+        escribirVector(salida, mascaras);
+    }
+
+    // Reemplaza el contenido por uno guardado con el mismo modo y periodos; false si no cuadra
+    bool cargar(std::istream& entrada) {
+        int32_t base, anios;
+        uint64_t productos;
+        bool leido = leerValor(entrada, base) && leerValor(entrada, anios) && leerValor(entrada, productos)
+                  && (puntoFijo ? leerVector(entrada, montosFijos) : leerVector(entrada, montos))
+                  && leerVector(entrada, cantidades) && leerVector(entrada, mascaras);
+        if (!leido || anios < 0) {
+            return false;
+        }
+        size_t celdas = productos * anios * periodos;
+        anioBase = base;
+        cantidadAnios = anios;
+        cantidadProductos = productos;
+        return (puntoFijo ? montosFijos.size() : montos.size()) == celdas && cantidades.size() == celdas
+            && mascaras.size() == productos * anios * palabras;
+    }
+};
+
+struct VarianteNombre {
+    Simbolo nombre;
+    uint32_t ocurrencias; // Registros que usaron esta variante
+};
+
+// Variantes del nombre de un producto con sus ocurrencias. Casi todos los
+// productos tienen uno o dos nombres, que se guardan en línea sin reservar
+// memoria; a partir del tercero van a un vector aparte, y desde UMBRAL_TABLA
+// variantes se buscan con una tabla de dispersión en lugar de recorrerlas.
+class VariantesNombre {
+private:
+    static constexpr size_t EN_LINEA = 2;
+    static constexpr size_t UMBRAL_TABLA = 8;
+
+    struct Desborde {
+        std::vector<VarianteNombre> variantes;
+        TablaDispersion tabla; // Sólo se llena desde UMBRAL_TABLA variantes
+    };
+
+    std::array<VarianteNombre, EN_LINEA> enLinea;
+    uint32_t cantidadEnLinea = 0;
+    std::unique_ptr<Desborde> desborde;
+
+public:
+    void agregar(Simbolo nombre, uint32_t ocurrencias = 1) {
+        if (!desborde) {
+            for (uint32_t i = 0; i < cantidadEnLinea; ++i) {
+                if (enLinea[i].nombre == nombre) {
+                    enLinea[i].ocurrencias += ocurrencias;
+                    return;
+                }
+            }
+            if (cantidadEnLinea < EN_LINEA) {
+                enLinea[cantidadEnLinea++] = VarianteNombre{ nombre, ocurrencias };
+                return;
+            }
+            desborde = std::make_unique<Desborde>();
+            desborde->variantes.assign(enLinea.begin(), enLinea.begin() + cantidadEnLinea);
+        }
+
+        std::vector<VarianteNombre>& variantes = desborde->variantes;
+        uint32_t indice = TablaDispersion::VACIA;
+        if (variantes.size() >= UMBRAL_TABLA) {
+            indice = desborde->tabla.buscar(hashSimbolo(nombre), [&](uint32_t i) { return variantes[i].nombre == nombre; });
+        } else {
+            for (uint32_t i = 0; i < variantes.size(); ++i) {
+                if (variantes[i].nombre == nombre) {
+                    indice = i;
+                    break;
+                }
+            }
+        }
+        if (indice != TablaDispersion::VACIA) {
+            variantes[indice].ocurrencias += ocurrencias;
+            return;
+        }
+
+        variantes.push_back(VarianteNombre{ nombre, ocurrencias });
+        if (variantes.size() >= UMBRAL_TABLA) {
+            // Al llegar al umbral se indexan todas; después, sólo la nueva
+            uint32_t desde = variantes.size() == UMBRAL_TABLA ? 0 : static_cast<uint32_t>(variantes.size() - 1);
+            for (uint32_t i = desde; i < variantes.size(); ++i) {
+                desborde->tabla.reservar(i + 1, [&](uint32_t j) { return hashSimbolo(variantes[j].nombre); });
+                desborde->tabla.insertar(hashSimbolo(variantes[i].nombre), i);
+            }
+        }
+    }
+
+    // La variante más usada; ante un empate, la primera que apareció
+    Simbolo dominante() const {
+        const VarianteNombre* mejor = begin();
+        for (const VarianteNombre* v = begin(); v != end(); ++v) {
+            if (v->ocurrencias > mejor->ocurrencias) {
+                mejor = v;
+            }
+        }
+        return mejor->nombre;
+    }
+
+    size_t size() const { return desborde ? desborde->variantes.size() : cantidadEnLinea; }
+    bool empty() const { return size() == 0; }
+    const VarianteNombre* begin() const { return desborde ? desborde->variantes.data() : enLinea.data(); }
+    const VarianteNombre* end() const { return begin() + size(); }
+};
+
+struct ProductoMapa {
+    Simbolo id; // Identificador internado en el pool del mapa
+    VariantesNombre nombres;
+
+    ProductoMapa(Simbolo pid) : id(pid) {}
 };
 
-class Cola {
-private:
-    std::queue<Bloque> cola;
+// Tienda de las canastas y ventas que agregan todas las tiendas
+const int TODAS_LAS_TIENDAS = -1;
+
+// Ventas guardadas sólo para las combinaciones que aparecen: cada terna
+// (producto, tienda, año) con ventas recibe su propia fila de un año en un cubo
+// aparte, así un producto vendido en pocas tiendas o pocos años no reserva
+// lugar para los demás. Se usa para las ventas mensuales por tienda y para las
+// diarias por producto (con la tienda en TODAS_LAS_TIENDAS). En el cubo todas
+// las filas usan el año ANIO_FILA y el año real va en la clave. Los productos
+// se identifican por su índice en el MapaProductos dueño.
+class VentasDispersas {
+public:
+    struct Clave {
+        uint32_t producto;
+        int tienda;
+        int anio;
+    };
+
+private:
+    static constexpr int ANIO_FILA = 0;
+
+    TablaDispersion tabla;
+    std::vector<Clave> claves; // Clave de cada fila del cubo
+    CuboVentas cubo;
+
+    static size_t hashClave(const Clave& clave) {
+        uint64_t h = ((uint64_t(clave.producto) << 32) | uint32_t(clave.tienda)) * 0x9E3779B97F4A7C15ull;
+        h = (h ^ (h >> 29) ^ uint32_t(clave.anio)) * 0xBF58476D1CE4E5B9ull;
+        return static_cast<size_t>(h ^ (h >> 32));
+    }
+
+public:
+    static constexpr uint32_t NO_ENCONTRADA = TablaDispersion::VACIA;
+
+    explicit VentasDispersas(bool puntoFijo, int periodos = 12) : cubo(puntoFijo, periodos) {}
+
+    uint32_t buscar(uint32_t producto, int tienda, int anio) const {
+        return tabla.buscar(hashClave(Clave{ producto, tienda, anio }), [&](uint32_t i) {
+            return claves[i].producto == producto && claves[i].tienda == tienda && claves[i].anio == anio;
+        });
+    }
+
+    // Fila del cubo para el producto en la tienda y el año, creándola si no existe
+    uint32_t buscarOCrear(uint32_t producto, int tienda, int anio) {
+        Clave clave{ producto, tienda, anio };
+        uint32_t fila = buscar(producto, tienda, anio);
+        if (fila != NO_ENCONTRADA) {
+            return fila;
+        }
+        tabla.reservar(claves.size() + 1, [&](uint32_t i) { return hashClave(claves[i]); });
+        claves.push_back(clave);
+        cubo.agregarProducto();
+        tabla.insertar(hashClave(clave), static_cast<uint32_t>(claves.size() - 1));
+        return static_cast<uint32_t>(claves.size() - 1);
+    }
+
+    // Suma una venta en un periodo de la fila
+    void sumar(uint32_t fila, int periodo, double monto, int64_t montoFijo, int64_t cantidad) {
+        cubo.sumar(fila, ANIO_FILA, periodo, monto, montoFijo, cantidad);
+    }
+
+    // Suma las filas de otro conjunto; productoDestino traduce sus índices de producto a los de este
+    void fusionar(const VentasDispersas& origen, const std::vector<uint32_t>& productoDestino) {
+        for (size_t fila = 0; fila < origen.size(); ++fila) {
+            const Clave& clave = origen.claves[fila];
+            cubo.sumarFila(buscarOCrear(productoDestino[clave.producto], clave.tienda, clave.anio), origen.cubo, fila);
+        }
+    }
+
+    // Suma todas las tiendas de cada producto en el cubo por producto
+    void acumularEnProductos(CuboVentas& productos) const {
+        for (size_t fila = 0; fila < claves.size(); ++fila) {
+            productos.sumarAnio(claves[fila].producto, claves[fila].anio, cubo, fila, 0);
+        }
+    }
+
+    // Suma una fila en el producto de un cubo agrupando sus periodos, como CuboVentas::sumarAgrupado
+    template <typename Grupo>
+    void sumarAgrupado(CuboVentas& destino, size_t producto, uint32_t fila, Grupo grupo) const {
+        destino.sumarAgrupado(producto, claves[fila].anio, cubo, fila, 0, grupo);
+    }
+
+    void clear() {
+        claves.clear();
+        tabla.limpiar();
+        cubo.limpiar();
+    }
+
+    void guardar(std::ostream& salida) const {
+        escribirVector(salida, claves);
+        cubo.guardar(salida);
+    }
+
+    // Carga en un conjunto vacío las filas guardadas; los productos deben ser menores que cantidadProductos
+    bool cargar(std::istream& entrada, size_t cantidadProductos) {
+        if (!leerVector(entrada, claves) || !cubo.cargar(entrada) || cubo.filas() != claves.size()
+            || cubo.anios() > 1 || (cubo.anios() == 1 && cubo.primerAnio() != ANIO_FILA)) {
+            return false;
+        }
+        for (uint32_t fila = 0; fila < claves.size(); ++fila) {
+            if (claves[fila].producto >= cantidadProductos || claves[fila].anio < ANIO_MINIMO
+                || claves[fila].anio > ANIO_MAXIMO) {
+                return false;
+            }
+            tabla.reservar(fila + 1, [&](uint32_t i) { return hashClave(claves[i]); });
+            tabla.insertar(hashClave(claves[fila]), fila);
+        }
+        return true;
+    }
+
+    size_t size() const { return claves.size(); }
+    const Clave& clave(size_t fila) const { return claves[fila]; }
+    uint64_t mascara(size_t fila) const { return cubo.mascara(fila, 0); } // Sólo con hasta 64 periodos
+    bool conVentas(size_t fila, int periodo) const { return cubo.conVentas(fila, 0, periodo); }
+    double monto(size_t fila, int periodo) const { return cubo.monto(fila, 0, periodo); }
+    bool enPuntoFijo() const { return cubo.enPuntoFijo(); }
+    const int64_t* cantidadesDe(size_t fila) const { return cubo.cantidadesDe(fila, 0); }
+};
+
+// Tabla de productos indexada por el símbolo del identificador. Los productos
+// viven en un vector denso en orden de inserción y la tabla Robin Hood sólo
+// guarda su índice, que es también su fila en el cubo de ventas; una búsqueda
+// compara enteros en ranuras contiguas. Según las opciones también se guardan
+// las ventas de cada producto por tienda y por día, sólo en los años que las tienen.
+class MapaProductos {
+private:
+    TablaDispersion tabla;
+    std::vector<ProductoMapa> productos;
+    CuboVentas cubo;
+    std::unique_ptr<VentasDispersas> tiendas; // Nulo si no se agrega por tienda; periodos de un mes
+    std::unique_ptr<VentasDispersas> diario; // Nulo si no se agrega por día; periodos de un día, todas las tiendas
+
+public:
+    static constexpr uint32_t NO_ENCONTRADO = TablaDispersion::VACIA;
+
+    explicit MapaProductos(const OpcionesAgregacion& opciones = OpcionesAgregacion())
+        : cubo(opciones.puntoFijo),
+          tiendas(opciones.porTienda ? std::make_unique<VentasDispersas>(opciones.puntoFijo) : nullptr),
+          diario(opciones.diario ? std::make_unique<VentasDispersas>(opciones.puntoFijo, DIAS_POR_ANIO) : nullptr) {}
+
+    uint32_t buscar(Simbolo id) const {
+        return tabla.buscar(hashSimbolo(id), [&](uint32_t indice) { return productos[indice].id == id; });
+    }
+
+    // Índice del producto, creándolo con ventas en cero si no existe
+    uint32_t buscarOCrear(Simbolo id) {
+        uint32_t indice = buscar(id);
+        if (indice != NO_ENCONTRADO) {
+            return indice;
+        }
+        tabla.reservar(productos.size() + 1, [&](uint32_t i) { return hashSimbolo(productos[i].id); });
+        productos.emplace_back(id);
+        cubo.agregarProducto();
+        tabla.insertar(hashSimbolo(id), static_cast<uint32_t>(productos.size() - 1));
+        return static_cast<uint32_t>(productos.size() - 1);
+    }
+
+    // Vacía el mapa conservando la memoria reservada, para reutilizarlo entre bloques
+    void clear() {
+        productos.clear();
+        tabla.limpiar();
+        cubo.limpiar();
+        if (tiendas) {
+            tiendas->clear();
+        }
+        if (diario) {
+            diario->clear();
+        }
+    }
+
+    // Guarda productos, variantes de nombre y ventas; los símbolos son los del pool del mapa
+    void guardar(std::ostream& salida) const {
+        escribirValor(salida, uint64_t(productos.size()));
+        for (const ProductoMapa& producto : productos) {
+            escribirValor(salida, producto.id);
+            escribirValor(salida, uint32_t(producto.nombres.size()));
+            for (const VarianteNombre& variante : producto.nombres) {
+                escribirValor(salida, variante);
+            }
+        }
+        cubo.guardar(salida);
+        if (tiendas) {
+            tiendas->guardar(salida);
+        }
+        if (diario) {
+            diario->guardar(salida);
+        }
+    }
+
+    // Carga en un mapa vacío, con las mismas opciones, lo que escribió guardar;
+    // false si el contenido no es coherente con un pool de cantidadSimbolos
+    bool cargar(std::istream& entrada, size_t cantidadSimbolos) {
+        uint64_t cantidad;
+        if (!leerValor(entrada, cantidad)) {
+            return false;
+        }
+        for (uint64_t i = 0; i < cantidad; ++i) {
+            Simbolo id;
+            uint32_t variantes;
+            if (!leerValor(entrada, id) || !leerValor(entrada, variantes) || id >= cantidadSimbolos || buscarOCrear(id) != i) {
+                return false;
+            }
+            for (uint32_t v = 0; v < variantes; ++v) {
+                VarianteNombre variante;
+                if (!leerValor(entrada, variante) || variante.nombre >= cantidadSimbolos) {
+                    return false;
+                }
+                productos[i].nombres.agregar(variante.nombre, variante.ocurrencias);
+            }
+        }
+        // Los cubos guardados reemplazan las filas en cero que creó buscarOCrear
+        return cubo.cargar(entrada) && cubo.filas() == productos.size()
+            && (!tiendas || tiendas->cargar(entrada, productos.size()))
+            && (!diario || diario->cargar(entrada, productos.size()));
+    }
+
+    size_t size() const { return productos.size(); }
+    bool empty() const { return productos.empty(); }
+    ProductoMapa& operator[](size_t indice) { return productos[indice]; }
+    const ProductoMapa& operator[](size_t indice) const { return productos[indice]; }
+    CuboVentas& ventas() { return cubo; }
+    const CuboVentas& ventas() const { return cubo; }
+    VentasDispersas* ventasPorTienda() { return tiendas.get(); }
+    const VentasDispersas* ventasPorTienda() const { return tiendas.get(); }
+    VentasDispersas* ventasDiarias() { return diario.get(); }
+    const VentasDispersas* ventasDiarias() const { return diario.get(); }
+};
+
+struct Canasta {
+    int anio;
+    int tienda = TODAS_LAS_TIENDAS;
+    std::vector<Simbolo> nombres; // Símbolos del pool de productos
+    std::vector<Simbolo> ids;
+    std::array<double, 12> precios;  // Arreglo de 12 precios
+
+    // Constructor
+    Canasta(int a, int t = TODAS_LAS_TIENDAS) : anio(a), tienda(t), precios{0} {}
+
+    // Método para agregar un nombre
+    void agregarNombre(Simbolo nombre) {
+        nombres.push_back(nombre);
+    }
+
+    // Método para agregar un ID
+    void agregarId(Simbolo id) {
+        ids.push_back(id);
+    }
+
+    // Método para establecer el precio de un mes específico
+    void setPrecio(int mes, double precio) {
+        if (mes >= 0 && mes < 12) {
+            precios[mes] = precio;
+        }
+    }
+
+    // Método para obtener el precio de un mes específico
+    double getPrecio(int mes) const {
+        if (mes >= 0 && mes < 12) {
+            return precios[mes];
+        }
+        return 0.0;  // Retorna 0 si el mes es inválido
+    }
+};
+
+const char* describirEstado(EstadoRegistro estado) {
+    switch (estado) {
+        case EstadoRegistro::Correcto: return "Correcto.";
+        case EstadoRegistro::CamposInsuficientes: return "Registro con menos campos de los esperados.";
+        case EstadoRegistro::FechaInvalida: return "Fecha con formato inválido.";
+        case EstadoRegistro::ErrorConversion: return "Error de conversión en algún campo.";
+        case EstadoRegistro::FueraDeRango: return "Valor fuera de rango en algún campo numérico.";
+    }
+    return "Error desconocido.";
+}
+
+// Convierte un número con std::from_chars. Igual que stoi/stod se aceptan
+// espacios iniciales y un signo '+', y se ignora el texto que siga al número.
+template <typename T>
+EstadoRegistro convertirNumero(std::string_view texto, T& valor) {
+    const char* inicio = texto.data();
+    const char* fin = texto.data() + texto.size();
+    while (inicio < fin && std::isspace(static_cast<unsigned char>(*inicio))) {
+        ++inicio;
+    }
+    if (inicio + 1 < fin && *inicio == '+' && inicio[1] != '-') {
+        ++inicio;
+    }
+    auto resultado = std::from_chars(inicio, fin, valor);
+    if (resultado.ec == std::errc::invalid_argument) {
+        return EstadoRegistro::ErrorConversion;
+    }
+    if (resultado.ec == std::errc::result_out_of_range) {
+        return EstadoRegistro::FueraDeRango;
+    }
+    return EstadoRegistro::Correcto;
+}
+
+inline bool esDigito(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Lee una fecha AAAA-MM-DD. El formato fijo se decodifica directamente; si no
+// coincide se aceptan números de cualquier largo separados por un carácter.
+EstadoRegistro obtenerFecha(std::string_view texto, Fecha& fecha) {
+    const char* p = texto.data();
+    if (texto.size() >= 10 && esDigito(p[0]) && esDigito(p[1]) && esDigito(p[2]) && esDigito(p[3])
+        && esDigito(p[5]) && esDigito(p[6]) && esDigito(p[8]) && esDigito(p[9])) {
+        fecha.anio = (p[0] - '0') * 1000 + (p[1] - '0') * 100 + (p[2] - '0') * 10 + (p[3] - '0');
+        fecha.mes = (p[5] - '0') * 10 + (p[6] - '0');
+        fecha.dia = (p[8] - '0') * 10 + (p[9] - '0');
+    } else {
+        int* partes[3] = { &fecha.anio, &fecha.mes, &fecha.dia };
+        const char* actual = p;
+        const char* fin = p + texto.size();
+        for (int i = 0; i < 3; ++i) {
+            while (actual < fin && std::isspace(static_cast<unsigned char>(*actual))) {
+                ++actual;
+            }
+            auto resultado = std::from_chars(actual, fin, *partes[i]);
+            if (resultado.ec != std::errc()) {
+                return EstadoRegistro::FechaInvalida;
+            }
+            actual = resultado.ptr + 1; // Salta el delimitador
+        }
+    }
+    if (fecha.mes < 1 || fecha.mes > 12) {
+        return EstadoRegistro::FechaInvalida; // Se usa como índice de los 12 meses
+    }
+    if (fecha.anio < ANIO_MINIMO || fecha.anio > ANIO_MAXIMO) {
+        return EstadoRegistro::FueraDeRango; // Un año absurdo ensancharía el cubo de todos los productos
+    }
+    return EstadoRegistro::Correcto;
+}
+
+// Lee un monto decimal directamente en unidades de ESCALA_MONEDA, sin pasar por
+// double. Los decimales que sobran se redondean al más cercano (las mitades,
+// alejándose de cero). Como from_chars en el modo double se acepta un exponente
+// ("1.5e1" vale 15) y, como en convertirNumero, se ignora lo que sigue al número.
+EstadoRegistro convertirMontoFijo(std::string_view texto, int64_t& valor) {
+    const char* p = texto.data();
+    const char* fin = texto.data() + texto.size();
+    while (p < fin && std::isspace(static_cast<unsigned char>(*p))) {
+        ++p;
+    }
+    bool negativo = false;
+    if (p < fin && (*p == '-' || *p == '+')) {
+        negativo = *p == '-';
+        ++p;
+    }
+    const char* inicioEntero = p;
+    while (p < fin && esDigito(*p)) {
+        ++p;
+    }
+    const char* finEntero = p;
+    const char* inicioFraccion = p;
+    const char* finFraccion = p;
+    if (p < fin && *p == '.') {
+        inicioFraccion = ++p;
+        while (p < fin && esDigito(*p)) {
+            ++p;
+        }
+        finFraccion = p;
+    }
+    if (finEntero == inicioEntero && finFraccion == inicioFraccion) {
+        return EstadoRegistro::ErrorConversion;
+    }
+    // Una 'e' sin dígitos detrás no es parte del número, igual que en from_chars
+    long exponente = 0;
+    if (p < fin && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        bool exponenteNegativo = false;
+        if (q < fin && (*q == '-' || *q == '+')) {
+            exponenteNegativo = *q == '-';
+            ++q;
+        }
+        for (; q < fin && esDigito(*q); ++q) {
+            if (exponente < 100000) { // Más allá ya no cabe en int64_t o todo es cero
+                exponente = exponente * 10 + (*q - '0');
+            }
+        }
+        if (exponenteNegativo) {
+            exponente = -exponente;
+        }
+    }
+
+    // Dígitos de la mantisa sin el punto; el punto queda después de "punto" de
+    // ellos. Se leen hasta DECIMALES_MONEDA decimales y el primero sobrante
+    // decide el redondeo.
+    long digitosEntero = finEntero - inicioEntero;
+    long digitos = digitosEntero + (finFraccion - inicioFraccion);
+    auto digito = [&](long i) -> int {
+        if (i < 0 || i >= digitos) {
+            return 0;
+        }
+        return (i < digitosEntero ? inicioEntero[i] : inicioFraccion[i - digitosEntero]) - '0';
+    };
+    long punto = digitosEntero + exponente;
+    int64_t escalado = 0;
+    for (long i = 0; i < punto + DECIMALES_MONEDA; ++i) {
+        if (__builtin_mul_overflow(escalado, 10, &escalado) || __builtin_add_overflow(escalado, digito(i), &escalado)) {
+            return EstadoRegistro::FueraDeRango;
+        }
+    }
+    if (digito(punto + DECIMALES_MONEDA) >= 5 && __builtin_add_overflow(escalado, 1, &escalado)) {
+        return EstadoRegistro::FueraDeRango;
+    }
+    valor = negativo ? -escalado : escalado;
+    return EstadoRegistro::Correcto;
+}
+
+// Columnas que lee procesarRegistro: fecha, tienda, producto, cantidad, nombre
+// y monto. Las demás se cuentan pero no se arman (ver procesarLinea).
+const uint64_t COLUMNAS_REGISTRO = (1 << 0) | (1 << 2) | (1 << 6) | (1 << 7) | (1 << 8) | (1 << 9);
+const uint64_t TODAS_LAS_COLUMNAS = ~uint64_t(0);
+
+EstadoRegistro procesarRegistro(const Campos& campos, RegistroCompra& registro, const OpcionesAgregacion& opciones) {
+    if (campos.size() < 10) {
+        return EstadoRegistro::CamposInsuficientes;
+    }
+    EstadoRegistro estado = obtenerFecha(campos[0], registro.fecha);
+    if (estado != EstadoRegistro::Correcto) {
+        return estado;
+    }
+    // Por día, la fecha se usa como índice del día del año y debe existir
+    if (opciones.diario && (registro.fecha.dia < 1 || registro.fecha.dia > DIAS_DEL_MES[registro.fecha.mes - 1]
+                            || (registro.fecha.mes == 2 && registro.fecha.dia == 29 && !esBisiesto(registro.fecha.anio)))) {
+        return EstadoRegistro::FechaInvalida;
+    }
+    registro.identificadorProducto = campos[6];
+    registro.hashProducto = hashIdentificador(campos[6]);
+    registro.nombre = campos[8];
+
+    if ((estado = convertirNumero(campos[2], registro.numeroTienda)) != EstadoRegistro::Correcto
+        || (estado = convertirNumero(campos[7], registro.cantidad)) != EstadoRegistro::Correcto
+        || (estado = opciones.puntoFijo ? convertirMontoFijo(campos[9], registro.montoFijo)
+                               : convertirNumero(campos[9], registro.monto)) != EstadoRegistro::Correcto) {
+        return estado;
+    }
+    return EstadoRegistro::Correcto;
+}
+
+
+// Máscaras de los caracteres estructurales de una ventana de 64 bytes: el bit i
+// corresponde al byte i de la ventana.
+struct MascarasCSV {
+    uint64_t separadores; // ';'
+    uint64_t comillas;    // '"'
+    uint64_t saltos;      // '\n'
+};
+
+MascarasCSV escanear64Escalar(const char* p) {
+    MascarasCSV m = { 0, 0, 0 };
+    for (int i = 0; i < 64; ++i) {
+        uint64_t bit = uint64_t(1) << i;
+        if (p[i] == ';') m.separadores |= bit;
+        else if (p[i] == '"') m.comillas |= bit;
+        else if (p[i] == '\n') m.saltos |= bit;
+    }
+    return m;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+MascarasCSV escanear64SSE(const char* p) {
+    const __m128i separador = _mm_set1_epi8(';');
+    const __m128i comilla = _mm_set1_epi8('"');
+    const __m128i salto = _mm_set1_epi8('\n');
+    MascarasCSV m = { 0, 0, 0 };
+    for (int i = 0; i < 4; ++i) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i));
+        m.separadores |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, separador)))) << (16 * i);
+        m.comillas |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, comilla)))) << (16 * i);
+        m.saltos |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, salto)))) << (16 * i);
+    }
+    return m;
+}
+
+__attribute__((target("avx2")))
+MascarasCSV escanear64AVX2(const char* p) {
+    const __m256i separador = _mm256_set1_epi8(';');
+    const __m256i comilla = _mm256_set1_epi8('"');
+    const __m256i salto = _mm256_set1_epi8('\n');
+    MascarasCSV m = { 0, 0, 0 };
+    for (int i = 0; i < 2; ++i) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32 * i));
+        m.separadores |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, separador)))) << (32 * i);
+        m.comillas |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, comilla)))) << (32 * i);
+        m.saltos |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, salto)))) << (32 * i);
+    }
+    return m;
+}
+#endif
+
+// Elige una sola vez la mejor implementación que soporte el procesador
+using FuncionEscaneo = MascarasCSV (*)(const char*);
+
+FuncionEscaneo seleccionarEscaneo() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return escanear64AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return escanear64SSE;
+    }
+#endif
+    return escanear64Escalar;
+}
+
+const FuncionEscaneo escanear64 = seleccionarEscaneo();
+
+// Escanea hasta 64 bytes; si quedan menos se copian a una ventana rellenada con ceros
+MascarasCSV escanearVentana(const char* p, size_t restantes) {
+    if (restantes >= 64) {
+        return escanear64(p);
+    }
+    alignas(64) char ventana[64] = {};
+    std::memcpy(ventana, p, restantes);
+    return escanear64(ventana);
+}
+
+// Bit i = paridad de las comillas en las posiciones 0..i (1 = dentro de comillas)
+inline uint64_t prefijoXor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// Quita las comillas externas y deja vacíos los campos con solo espacios
+std::string_view normalizarCampo(std::string_view campo) {
+    if (!campo.empty() && campo.front() == '"' && campo.back() == '"') {
+        campo = campo.substr(1, campo.length() - 2);
+    }
+    if (std::all_of(campo.begin(), campo.end(), [](unsigned char ch) { return std::isspace(ch); })) {
+        return std::string_view();
+    }
+    return campo;
+}
+
+// Campo en construcción: mientras el texto sea un único tramo de la línea es
+// una vista; si hay que unir tramos se arma en arena.temporal. Un campo
+// omitido sólo recuerda si tuvo texto: no se une, ni se copia, ni se normaliza.
+class CampoEnCurso {
+private:
+    ArenaTemporal& arena;
+    std::string_view tramo;
+    bool compuesto;
+    bool omitido;
+    bool conTexto;
+
+public:
+    explicit CampoEnCurso(ArenaTemporal& a) : arena(a), compuesto(false), omitido(false), conTexto(false) {}
+
+    void omitir(bool o) {
+        omitido = o;
+    }
+
+    void agregar(const char* texto, size_t largo) {
+        if (largo == 0) {
+            return;
+        }
+        if (omitido) {
+            conTexto = true;
+            return;
+        }
+        if (!compuesto && tramo.empty()) {
+            tramo = std::string_view(texto, largo);
+            return;
+        }
+        if (!compuesto) {
+            arena.temporal.assign(tramo.data(), tramo.size());
+            compuesto = true;
+        }
+        arena.temporal.append(texto, largo);
+    }
+
+    bool empty() const {
+        if (omitido) {
+            return !conTexto;
+        }
+        return compuesto ? arena.temporal.empty() : tramo.empty();
+    }
+
+    // Devuelve el campo ya normalizado; solo los compuestos se copian a la arena
+    std::string_view terminar() {
+        if (omitido) {
+            limpiar();
+            return std::string_view();
+        }
+        std::string_view campo = normalizarCampo(compuesto ? std::string_view(arena.temporal) : tramo);
+        if (compuesto && !campo.empty()) {
+            campo = arena.copiar(campo);
+        }
+        limpiar();
+        return campo;
+    }
+
+    void limpiar() {
+        tramo = std::string_view();
+        compuesto = false;
+        conTexto = false;
+    }
+};
+
+// Divide una línea en campos. Se recorre en ventanas de 64 bytes y solo se
+// visitan las posiciones de comillas, saltos y separadores fuera de comillas;
+// el texto entre ellas queda como vista a la línea, sin copiarse. Los campos
+// fuera de la máscara "columnas" quedan vacíos sin armarse, y la línea se deja
+// de recorrer en cuanto se tiene la última columna pedida.
+void procesarLinea(std::string_view linea, Campos& campos, ArenaTemporal& arena, uint64_t columnas = TODAS_LAS_COLUMNAS) {
+    CampoEnCurso campo(arena);
+    bool dentroDeCampo = false;
+    bool campoFinalizado = false;
+    const char* datos = linea.data();
+    size_t inicioTexto = 0; // Inicio del texto normal aún no agregado a campo
+    size_t columnasNecesarias = 64 - __builtin_clzll(columnas);
+
+    // Cierra el campo en curso y prepara el siguiente; false si ya no hace falta seguir
+    auto cerrarCampo = [&]() {
+        campos.agregar(campo.terminar());
+        campo.omitir(campos.size() < 64 && !((columnas >> campos.size()) & 1));
+        return campos.size() < columnasNecesarias;
+    };
+
+    campos.limpiar();
+    campo.omitir(!(columnas & 1));
+    for (size_t base = 0; base < linea.size(); base += 64) {
+        MascarasCSV m = escanearVentana(datos + base, linea.size() - base);
+        uint64_t dentro = prefijoXor(m.comillas) ^ (dentroDeCampo ? ~uint64_t(0) : 0);
+        uint64_t estructurales = m.comillas | m.saltos | (m.separadores & ~dentro);
+
+        while (estructurales) {
+            size_t posicion = base + __builtin_ctzll(estructurales);
+            estructurales &= estructurales - 1;
+
+            campo.agregar(datos + inicioTexto, posicion - inicioTexto);
+            inicioTexto = posicion + 1;
+
+            char c = datos[posicion];
+            if (c == '"') {
+                dentroDeCampo = !dentroDeCampo;
+                if (!dentroDeCampo) {
+                    if (!cerrarCampo()) {
+                        return;
+                    }
+                    campoFinalizado = false;
+                }
+            } else if (c == ';') {
+                if (campoFinalizado == true && !cerrarCampo()) {
+                    return;
+                }
+                campoFinalizado = true;
+                campo.limpiar();
+            }
+            // Los saltos de línea dentro de comillas se omiten del campo
+        }
+    }
+    campo.agregar(datos + inicioTexto, linea.size() - inicioTexto);
+
+    if (!campo.empty() && campoFinalizado) {
+        cerrarCampo();
+    }
+}
+
+// Tamaño aproximado de cada tramo del archivo mapeado que procesa un hilo
+const size_t TAMANO_TRAMO = 8 * 1024 * 1024;
+
+// Indica si el texto tiene una cantidad impar de comillas
+bool comillasImpares(const char* inicio, const char* fin) {
+    uint64_t paridad = 0;
+    for (const char* p = inicio; p < fin; p += 64) {
+        paridad ^= __builtin_popcountll(escanearVentana(p, fin - p).comillas);
+    }
+    return paridad & 1;
+}
+
+// Máquina de estados que arma registros de una o más líneas: un salto de línea
+// cierra el registro solo si la cantidad de comillas vista desde su inicio es
+// par. El estado se conserva entre llamadas, de modo que un registro puede
+// cruzar cualquier cantidad de líneas y de recargas del búfer.
+class EnsambladorRegistros {
+private:
+    bool dentroDeComillas;
+
+public:
+    explicit EnsambladorRegistros(bool dentro = false) : dentroDeComillas(dentro) {}
+
+    // Devuelve la posición del salto que cierra el registro en curso dentro de
+    // [inicio, fin), o fin si el registro continúa después del texto. Tras
+    // encontrar un cierre el estado queda listo para el registro siguiente.
+    const char* buscarFin(const char* inicio, const char* fin) {
+        for (const char* base = inicio; base < fin; base += 64) {
+            MascarasCSV m = escanearVentana(base, fin - base);
+            uint64_t dentro = prefijoXor(m.comillas) ^ (dentroDeComillas ? ~uint64_t(0) : 0);
+            uint64_t saltos = m.saltos & ~dentro;
+            if (saltos) {
+                dentroDeComillas = false;
+                return base + __builtin_ctzll(saltos);
+            }
+            dentroDeComillas ^= __builtin_popcountll(m.comillas) & 1;
+        }
+        return fin;
+    }
+};
+
+// Separa un rango que empieza en un inicio de registro en las vistas de sus
+// registros. Las líneas vacías se omiten.
+void separarRegistros(std::string_view rango, std::vector<std::string_view>& lineas) {
+    EnsambladorRegistros ensamblador;
+    const char* inicio = rango.data();
+    const char* fin = rango.data() + rango.size();
+    while (inicio < fin) {
+        const char* finRegistro = ensamblador.buscarFin(inicio, fin);
+        if (finRegistro > inicio) {
+            lineas.emplace_back(inicio, finRegistro - inicio);
+        }
+        if (finRegistro == fin) {
+            break;
+        }
+        inicio = finRegistro + 1;
+    }
+}
+
+// Divide [inicio, fin) en tramos de aproximadamente tamanoTramo bytes que
+// empiezan en un inicio de registro real, de modo que cada tramo se puede
+// procesar por separado y el resultado es el mismo que una lectura secuencial.
+// En paralelo se cuenta la paridad de comillas de cada corte en bruto; su
+// acumulado dice si el corte cae dentro de un campo entre comillas, y desde ahí
+// cada corte avanza hasta el primer salto de línea fuera de comillas. Los
+// tamaños no dependen de la cantidad de hilos. Devuelve los inicios de los
+// tramos seguidos de fin.
+std::vector<size_t> dividirEnTramos(const char* datos, size_t inicio, size_t fin, size_t tamanoTramo) {
+    long cantidad = std::max<long>(1, (fin - inicio + tamanoTramo - 1) / tamanoTramo);
+    std::vector<size_t> cortes(cantidad + 1);
+    std::vector<uint8_t> dentroDeComillas(cantidad + 1, 0);
+    std::vector<size_t> inicios(cantidad);
+    for (long i = 0; i < cantidad; ++i) {
+        cortes[i] = inicio + i * tamanoTramo;
+    }
+    cortes[cantidad] = fin;
+
+    #pragma omp parallel
+    {
+        #pragma omp for
+        for (long i = 0; i < cantidad; ++i) {
+            dentroDeComillas[i + 1] = comillasImpares(datos + cortes[i], datos + cortes[i + 1]);
+        }
+        #pragma omp single
+        for (long i = 1; i <= cantidad; ++i) {
+            dentroDeComillas[i] ^= dentroDeComillas[i - 1];
+        }
+        #pragma omp for
+        for (long i = 0; i < cantidad; ++i) {
+            if (i == 0) {
+                inicios[i] = inicio;
+                continue;
+            }
+            EnsambladorRegistros ensamblador(dentroDeComillas[i]);
+            const char* salto = ensamblador.buscarFin(datos + cortes[i], datos + fin);
+            inicios[i] = std::min<size_t>(salto - datos + 1, fin);
+        }
+    }
+
+    std::vector<size_t> tramos;
+    for (size_t inicioTramo : inicios) {
+        if (tramos.empty() || inicioTramo > tramos.back()) {
+            tramos.push_back(inicioTramo);
+        }
+    }
+    if (tramos.back() != fin) {
+        tramos.push_back(fin);
+    }
+    return tramos;
+}
+
+// Lector de bloques sobre una única fuente abierta durante toda la ejecución.
+// Si el archivo es regular se mapea completo en memoria y cada bloque es un
+// tramo del mapeo (ver dividirEnTramos) que un hilo de trabajo separa en
+// registros, sin copiarlos. Si no se puede mapear (tuberías, archivos vacíos) se
+// usa un único flujo con búfer. En ambos casos se evita reabrir el archivo en
+// cada bloque y el fin se detecta sin leer de más.
+class LectorBloques {
+private:
+    std::ifstream archivo;
+    std::streampos posicion_actual; // Posición del siguiente byte por leer
+    const char* mapa; // Contenido del archivo mapeado, nullptr en modo flujo
+    size_t tamano_mapa;
+    size_t posicion_mapa;
+    std::vector<size_t> tramos; // Inicios de los tramos del mapeo, seguidos del final
+    size_t tramoActual;
+    size_t bloquesLeidos;
+    std::vector<char> pendiente; // Bytes del flujo ya leídos que aún no entraron en un bloque
+    std::vector<std::pair<size_t, size_t>> limites; // Inicio y fin de cada registro en datos, se reutiliza
+    std::vector<std::pair<size_t, size_t>> rangos; // Con índice: los únicos rangos del archivo que se leen
+    size_t rangoActual;
+    bool restringido;
+    size_t bytesLeidos;
+    bool descartarCabecera;
+    static constexpr size_t TAMANO_LECTURA = 1024 * 1024;
+
+    bool mapear(const std::string& nombre_archivo) {
+        // Se revisa antes de abrir: abrir un FIFO bloquea y consume la conexión
+        // del escritor, que el flujo de respaldo ya no podría recibir
+        struct stat previo;
+        if (stat(nombre_archivo.c_str(), &previo) != 0 || !S_ISREG(previo.st_mode) || previo.st_size == 0) {
+            return false;
+        }
+        int fd = open(nombre_archivo.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* direccion = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd); // El mapeo sigue siendo válido después de cerrar el descriptor
+        if (direccion == MAP_FAILED) {
+            return false;
+        }
+        madvise(direccion, info.st_size, MADV_SEQUENTIAL);
+        mapa = static_cast<const char*>(direccion);
+        tamano_mapa = info.st_size;
+        return true;
+    }
+
+    // Agrega al búfer el siguiente trozo del flujo; devuelve false al llegar al final
+    bool recargar(std::vector<char>& datos) {
+        size_t anterior = datos.size();
+        datos.resize(anterior + TAMANO_LECTURA);
+        archivo.read(datos.data() + anterior, TAMANO_LECTURA);
+        size_t leidos = archivo.gcount();
+        datos.resize(anterior + leidos);
+        bytesLeidos += leidos;
+        return leidos > 0;
+    }
+
+    // Lee del flujo en trozos de TAMANO_LECTURA y arma los registros en una sola
+    // pasada; lo que queda después del último registro del bloque se guarda en
+    // pendiente para el siguiente, así ningún registro se pierde ni se repite.
+    void leerBloqueFlujo(Bloque& bloque, size_t tamano_bloque) {
+        std::vector<char>& datos = bloque.datos;
+        datos.swap(pendiente);
+        limites.clear();
+        EnsambladorRegistros ensamblador;
+        size_t inicioRegistro = 0;
+        size_t posicion = 0; // Hasta dónde ya se buscó el fin del registro en curso
+
+        while (limites.size() < tamano_bloque) {
+            const char* base = datos.data();
+            const char* finRegistro = ensamblador.buscarFin(base + posicion, base + datos.size());
+            size_t fin = finRegistro - base;
+            bool alFinal = fin == datos.size();
+            if (alFinal && recargar(datos)) {
+                posicion = fin; // El registro sigue en el trozo nuevo, con el estado conservado
+                continue;
+            }
+            if (descartarCabecera) {
+                descartarCabecera = false;
+            } else if (fin > inicioRegistro) {
+                limites.emplace_back(inicioRegistro, fin);
+            }
+            inicioRegistro = posicion = alFinal ? fin : fin + 1;
+            if (alFinal) {
+                break;
+            }
+        }
+
+        // Lo que sobra después del último registro pasa al siguiente bloque
+        pendiente.assign(datos.begin() + inicioRegistro, datos.end());
+        datos.resize(inicioRegistro);
+        posicion_actual = std::streampos(bytesLeidos - pendiente.size());
+
+        // Las vistas se crean al final, cuando datos ya no se va a realocar
+        for (const auto& [inicio, fin] : limites) {
+            bloque.lineas.emplace_back(datos.data() + inicio, fin - inicio);
+        }
+    }
+
+public:
+    LectorBloques(const std::string& nombre_archivo, bool usarMapeo)
+        : posicion_actual(0), mapa(nullptr), tamano_mapa(0), posicion_mapa(0), tramoActual(0), bloquesLeidos(0),
+          rangoActual(0), restringido(false), bytesLeidos(0), descartarCabecera(false) {
+        if (usarMapeo && mapear(nombre_archivo)) {
+            return;
+        }
+        archivo.open(nombre_archivo);
+        if (!archivo.is_open()) {
+            std::cerr << "No se pudo abrir el archivo" << std::endl;
+        }
+    }
+
+    ~LectorBloques() {
+        if (mapa) {
+            munmap(const_cast<char*>(mapa), tamano_mapa);
+        }
+    }
+
+    LectorBloques(const LectorBloques&) = delete;
+    LectorBloques& operator=(const LectorBloques&) = delete;
+
+    bool abierto() const {
+        return mapa || archivo.is_open();
+    }
+
+    bool mapeado() const {
+        return mapa != nullptr;
+    }
+
+    std::streampos posicion() const {
+        return mapa ? std::streampos(posicion_mapa) : posicion_actual;
+    }
+
+    // Todo el archivo mapeado; vacío en modo flujo
+    std::string_view contenido() const {
+        return mapa ? std::string_view(mapa, tamano_mapa) : std::string_view();
+    }
+
+    // Lee sólo estos rangos, en orden, cada uno como un bloque; deben empezar y
+    // terminar en límites de registro. Reemplaza a descartarPrimeraLinea y saltarA.
+    void leerSoloRangos(std::vector<std::pair<size_t, size_t>> seleccion) {
+        rangos = std::move(seleccion);
+        rangoActual = 0;
+        restringido = true;
+    }
+
+    // Continúa la lectura desde un desplazamiento que debe ser el inicio de un
+    // registro; se llama antes de dividirEnTramos y del primer leerCSV
+    void saltarA(size_t desplazamiento) {
+        if (mapa) {
+            posicion_mapa = std::min(desplazamiento, tamano_mapa);
+        } else if (archivo.is_open()) {
+            posicion_actual = std::streampos(desplazamiento);
+            archivo.seekg(posicion_actual);
+            bytesLeidos = desplazamiento;
+        }
+    }
+
+    // Descarta el registro de cabecera; en modo flujo se hace al armar el primer bloque
+    void descartarPrimeraLinea() {
+        if (mapa) {
+            EnsambladorRegistros ensamblador;
+            const char* fin = ensamblador.buscarFin(mapa + posicion_mapa, mapa + tamano_mapa);
+            posicion_mapa = std::min<size_t>(fin - mapa + 1, tamano_mapa);
+        } else {
+            descartarCabecera = true;
+        }
+    }
+
+    bool quedanLineasPorLeer() {
+        if (restringido) {
+            return rangoActual < rangos.size();
+        }
+        if (mapa) {
+            return posicion_mapa < tamano_mapa;
+        }
+        return !pendiente.empty() || (archivo.is_open() && archivo.peek() != std::ifstream::traits_type::eof());
+    }
+
+    // Calcula los tramos del resto del mapeo; conviene llamarlo desde el hilo
+    // principal porque usa todos los hilos de OpenMP
+    void dividirEnTramos(size_t tamanoTramo) {
+        if (mapa && tramos.empty()) {
+            tramos = ::dividirEnTramos(mapa, posicion_mapa, tamano_mapa, tamanoTramo);
+            tramoActual = 0;
+        }
+    }
+
+    // Toma un bloque de "libres" si hay alguno para reutilizar; sólo reserva uno
+    // nuevo mientras no haya suficientes en circulación
+    void leerCSV(Cola& cola, Cola& libres, int tamano_bloque) {
+        BloquePtr bloque;
+        if (libres.intentarPop(bloque)) {
+            bloque->reiniciar();
+        } else {
+            bloque = std::make_unique<Bloque>();
+        }
+        Bloque& bloque_actual = *bloque;
+        bloque_actual.numero = bloquesLeidos;
+
+        if (restringido) {
+            auto [inicio, fin] = rangos[rangoActual++];
+            if (mapa) {
+                bloque_actual.rango = std::string_view(mapa + inicio, std::min(fin, tamano_mapa) - std::min(inicio, tamano_mapa));
+            } else if (archivo.is_open()) {
+                archivo.clear();
+                archivo.seekg(std::streampos(inicio));
+                bloque_actual.datos.resize(fin - inicio);
+                archivo.read(bloque_actual.datos.data(), fin - inicio);
+                bloque_actual.datos.resize(archivo.gcount());
+                bloque_actual.rango = std::string_view(bloque_actual.datos.data(), bloque_actual.datos.size());
+            }
+        } else if (mapa) {
+            dividirEnTramos(TAMANO_TRAMO);
+            if (tramoActual + 1 < tramos.size()) {
+                bloque_actual.rango = std::string_view(mapa + tramos[tramoActual], tramos[tramoActual + 1] - tramos[tramoActual]);
+                posicion_mapa = tramos[++tramoActual];
+            }
+        } else if (archivo.is_open()) {
+            leerBloqueFlujo(bloque_actual, tamano_bloque);
+        }
+
+        if (!bloque_actual.lineas.empty() || !bloque_actual.rango.empty()) {
+            ++bloquesLeidos;
+            cola.push(std::move(bloque));
+        } else {
+            libres.intentarPush(bloque);
+        }
+    }
+};
+
+// Mes (anio * 12 + mes - 1) de una línea aún sin separar que empieza con
+// "AAAA-MM-DD", el mismo que daría obtenerFecha; -1 si empieza de otra forma
+int mesDelPrefijo(std::string_view linea) {
+    if (linea.size() < 11 || linea[0] != '"') {
+        return -1;
+    }
+    const char* p = linea.data() + 1;
+    if (!esDigito(p[0]) || !esDigito(p[1]) || !esDigito(p[2]) || !esDigito(p[3]) || p[4] != '-'
+        || !esDigito(p[5]) || !esDigito(p[6]) || p[7] != '-' || !esDigito(p[8]) || !esDigito(p[9])) {
+        return -1;
+    }
+    int anio = (p[0] - '0') * 1000 + (p[1] - '0') * 100 + (p[2] - '0') * 10 + (p[3] - '0');
+    int mes = (p[5] - '0') * 10 + (p[6] - '0');
+    return mes >= 1 && mes <= 12 ? anio * 12 + mes - 1 : -1;
+}
+
+// Convierte las líneas de un bloque en registros. No toca los mapas, así que
+// varios hilos pueden convertir bloques distintos al mismo tiempo. Con filtro
+// de fechas, las líneas cuyo prefijo cae fuera del rango se saltan antes de
+// separarlas; las que no tienen el prefijo esperado se filtran ya convertidas.
+void convertirBloque(Bloque& bloque, Campos& campos, const OpcionesAgregacion& opciones) {
+    if (bloque.lineas.empty() && !bloque.rango.empty()) {
+        separarRegistros(bloque.rango, bloque.lineas);
+    }
+    bool filtrar = opciones.filtraFechas();
+    bloque.registros.reserve(bloque.lineas.size());
+    for (const auto& linea : bloque.lineas) {
+        int mes = -1;
+        if (filtrar) {
+            mes = mesDelPrefijo(linea);
+            bloque.enOrden = bloque.enOrden && mes >= 0 && mes >= bloque.ultimoMes;
+            if (mes >= 0) {
+                bloque.primerMes = bloque.primerMes < 0 ? mes : bloque.primerMes;
+                bloque.ultimoMes = mes;
+                if (!opciones.admiteMes(mes)) {
+                    continue;
+                }
+            }
+        }
+        procesarLinea(linea, campos, bloque.arena, COLUMNAS_REGISTRO);
+        RegistroCompra registro;
+        EstadoRegistro estado = procesarRegistro(campos, registro, opciones);
+        if (estado != EstadoRegistro::Correcto) {
+            bloque.errores.push_back(estado); // Salta este registro y pasa al siguiente
+            bloque.mesesErrores.push_back(filtrar ? mes : mesDelPrefijo(linea));
+            continue;
+        }
+        if (filtrar && !opciones.admiteMes(registro.fecha.anio * 12 + registro.fecha.mes - 1)) {
+            continue;
+        }
+        bloque.registros.push_back(registro);
+    }
+}
+
+// Días desde 1970-01-01 de una fecha del calendario gregoriano. El día se
+// acota a los del mes: fuera del modo diario sólo importan el año y el mes, y
+// en él las fechas inexistentes ya se descartaron.
+int32_t diasDesdeEpoca(const Fecha& fecha) {
+    int dia = std::min(std::max(fecha.dia, 1), DIAS_DEL_MES[fecha.mes - 1] - (fecha.mes == 2 && !esBisiesto(fecha.anio)));
+    int y = fecha.anio - (fecha.mes <= 2);
+    int era = (y >= 0 ? y : y - 399) / 400;
+    unsigned anioEra = unsigned(y - era * 400);
+    unsigned diaAnio = (153 * (fecha.mes > 2 ? fecha.mes - 3 : fecha.mes + 9) + 2) / 5 + dia - 1;
+    unsigned diaEra = anioEra * 365 + anioEra / 4 - anioEra / 100 + diaAnio;
+    return era * 146097 + int(diaEra) - 719468;
+}
+
+Fecha fechaDesdeDias(int32_t dias) {
+    dias += 719468;
+    int era = (dias >= 0 ? dias : dias - 146096) / 146097;
+    unsigned diaEra = unsigned(dias - era * 146097);
+    unsigned anioEra = (diaEra - diaEra / 1460 + diaEra / 36524 - diaEra / 146096) / 365;
+    unsigned diaAnio = diaEra - (365 * anioEra + anioEra / 4 - anioEra / 100);
+    unsigned mesDesdeMarzo = (5 * diaAnio + 2) / 153;
+    int mes = int(mesDesdeMarzo < 10 ? mesDesdeMarzo + 3 : mesDesdeMarzo - 9);
+    int dia = int(diaAnio - (153 * mesDesdeMarzo + 2) / 5 + 1);
+    return Fecha{ int(anioEra) + era * 400 + (mes <= 2), mes, dia };
+}
+
+// Identifica una versión de pd.csv: tamaño, fecha de modificación y un hash
+// de sus primeros y últimos TAMANO_MUESTRA bytes (leer todo el archivo para
+// validar la caché costaría casi lo mismo que volver a separarlo).
+struct ClaveCsv {
+    uint64_t tamano;
+    int64_t modificacionSeg;
+    int64_t modificacionNs;
+    uint64_t hash;
+};
+
+const size_t TAMANO_MUESTRA = 64 * 1024;
+
+// Hash de los primeros y últimos TAMANO_MUESTRA bytes de los primeros "tamano" bytes del archivo
+bool hashMuestra(int fd, uint64_t tamano, uint64_t& hash) {
+    std::string muestra(std::min<uint64_t>(tamano, 2 * TAMANO_MUESTRA), '\0');
+    size_t inicial = std::min<uint64_t>(tamano, TAMANO_MUESTRA);
+    size_t final = muestra.size() - inicial;
+    if (pread(fd, &muestra[0], inicial, 0) != ssize_t(inicial)
+        || pread(fd, &muestra[inicial], final, tamano - final) != ssize_t(final)) {
+        return false;
+    }
+    hash = hashIdentificador(muestra);
+    return true;
+}
+
+// Abrir una FIFO bloquea hasta que aparece un escritor; los archivos
+// auxiliares sólo tienen sentido para un pd.csv regular, que se puede releer
+bool esArchivoRegular(const std::string& nombre) {
+    struct stat info;
+    return stat(nombre.c_str(), &info) == 0 && S_ISREG(info.st_mode);
+}
+
+bool obtenerClaveCsv(const std::string& nombre, ClaveCsv& clave) {
+    if (!esArchivoRegular(nombre)) {
+        return false;
+    }
+    int fd = open(nombre.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    bool leido = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && hashMuestra(fd, info.st_size, clave.hash);
+    close(fd);
+    if (!leido) {
+        return false;
+    }
+    clave.tamano = info.st_size;
+    clave.modificacionSeg = info.st_mtim.tv_sec;
+    clave.modificacionNs = info.st_mtim.tv_nsec;
+    return true;
+}
+
+// Caché columnar de los registros ya convertidos de pd.csv, en pd.csv.cache.
+// Después de la cabecera van las secciones, cada una alineada a 8 bytes: por
+// bloque, el fin de sus registros y de sus errores (así se rearman los mismos
+// bloques y las sumas dan idénticas); por registro, fecha como días desde
+// 1970, tienda, producto y nombre como índices del diccionario, cantidad y
+// monto (double, o entero de ESCALA_MONEDA en punto fijo); los errores de
+// conversión en orden, con el mes del prefijo de su línea (-1 si no se pudo
+// leer) para filtrarlos como convertirBloque; y el diccionario de textos. Los enteros se guardan en
+// el orden de bytes de la máquina que la escribió.
+enum SeccionCache {
+    FIN_BLOQUES,
+    FIN_ERRORES,
+    DIAS,
+    TIENDAS,
+    PRODUCTOS,
+    NOMBRES,
+    CANTIDADES,
+    MONTOS,
+    ERRORES,
+    MESES_ERRORES,
+    FIN_TEXTOS,
+    TEXTOS,
+    CANTIDAD_SECCIONES
+};
+
+const char MAGIA_CACHE[8] = { 'P', 'D', 'C', 'A', 'C', 'H', 'E', '2' };
+
+struct CabeceraCache {
+    char magia[8];
+    uint32_t puntoFijo; // Opciones que cambian qué registros y montos se guardan
+    uint32_t diario;
+    ClaveCsv csv;
+    uint64_t bloques;
+    uint64_t registros;
+    uint64_t errores;
+    uint64_t textos;
+    uint64_t desplazamientos[CANTIDAD_SECCIONES]; // Inicio de cada sección en el archivo
+    uint64_t tamanos[CANTIDAD_SECCIONES];         // Bytes de cada sección
+};
+
+std::string nombreCache(const std::string& csv) {
+    return csv + ".cache";
+}
+
+// Escribe la caché mientras se procesa el CSV. Cada columna va primero a su
+// propio archivo temporal, bloque por bloque, así la memoria no crece con la
+// cantidad de registros; al final se juntan detrás de la cabecera.
+class EscritorCache {
+private:
+    std::array<std::FILE*, CANTIDAD_SECCIONES> temporales{};
+    PoolSimbolos textos; // Diccionario de ids y nombres
+    uint64_t registros = 0;
+    uint64_t errores = 0;
+    uint64_t bloques = 0;
+    bool fallo = false;
+
+    // Búferes de un bloque, reutilizados
+    std::vector<int32_t> dias;
+    std::vector<int32_t> tiendas;
+    std::vector<uint32_t> productos;
+    std::vector<uint32_t> nombres;
+    std::vector<int64_t> cantidades;
+    std::vector<uint64_t> montos; // Bits del double o el entero de punto fijo
+
+    template <typename T>
+    void escribir(SeccionCache seccion, const T* datos, size_t cantidad) {
+        if (cantidad > 0 && std::fwrite(datos, sizeof(T), cantidad, temporales[seccion]) != cantidad) {
+            fallo = true;
+        }
+    }
+
+public:
+    EscritorCache() {
+        for (int i = 0; i < TEXTOS; ++i) {
+            temporales[i] = std::tmpfile();
+            fallo = fallo || temporales[i] == nullptr;
+        }
+    }
+
+    ~EscritorCache() {
+        for (std::FILE* temporal : temporales) {
+            if (temporal) {
+                std::fclose(temporal);
+            }
+        }
+    }
+
+    EscritorCache(const EscritorCache&) = delete;
+    EscritorCache& operator=(const EscritorCache&) = delete;
+
+    // Agrega los registros y errores de un bloque ya convertido; los bloques deben llegar en orden
+    void agregarBloque(const Bloque& bloque, bool puntoFijo) {
+        if (fallo) {
+            return;
+        }
+        dias.clear();
+        tiendas.clear();
+        productos.clear();
+        nombres.clear();
+        cantidades.clear();
+        montos.clear();
+        for (const RegistroCompra& registro : bloque.registros) {
+            dias.push_back(diasDesdeEpoca(registro.fecha));
+            tiendas.push_back(registro.numeroTienda);
+            productos.push_back(textos.internar(registro.identificadorProducto, registro.hashProducto));
+            nombres.push_back(textos.internar(registro.nombre));
+            cantidades.push_back(registro.cantidad);
+            uint64_t bits;
+            if (puntoFijo) {
+                std::memcpy(&bits, &registro.montoFijo, sizeof(bits));
+            } else {
+                std::memcpy(&bits, &registro.monto, sizeof(bits));
+            }
+            montos.push_back(bits);
+        }
+        escribir(DIAS, dias.data(), dias.size());
+        escribir(TIENDAS, tiendas.data(), tiendas.size());
+        escribir(PRODUCTOS, productos.data(), productos.size());
+        escribir(NOMBRES, nombres.data(), nombres.size());
+        escribir(CANTIDADES, cantidades.data(), cantidades.size());
+        escribir(MONTOS, montos.data(), montos.size());
+        for (EstadoRegistro estado : bloque.errores) {
+            uint8_t codigo = static_cast<uint8_t>(estado);
+            escribir(ERRORES, &codigo, 1);
+        }
+        escribir(MESES_ERRORES, bloque.mesesErrores.data(), bloque.mesesErrores.size());
+        registros += bloque.registros.size();
+        errores += bloque.errores.size();
+        ++bloques;
+        escribir(FIN_BLOQUES, &registros, 1);
+        escribir(FIN_ERRORES, &errores, 1);
+    }
+
+    // Junta las secciones en un archivo temporal y lo renombra, así nunca queda
+    // a la vista una caché a medio escribir. La clave es la del CSV al empezar
+    // a leerlo: si cambió durante la lectura, la caché no valdrá la próxima vez.
+    bool guardar(const std::string& csv, const ClaveCsv& clave, const OpcionesAgregacion& opciones) {
+        CabeceraCache cabecera{};
+        if (fallo) {
+            return false;
+        }
+        cabecera.csv = clave;
+        std::memcpy(cabecera.magia, MAGIA_CACHE, sizeof(MAGIA_CACHE));
+        cabecera.puntoFijo = opciones.puntoFijo;
+        cabecera.diario = opciones.diario;
+        cabecera.bloques = bloques;
+        cabecera.registros = registros;
+        cabecera.errores = errores;
+        cabecera.textos = textos.size();
+
+        // Diccionario: fin de cada texto y luego los bytes
+        std::vector<uint64_t> finTextos;
+        uint64_t bytes = 0;
+        for (Simbolo s = 0; s < textos.size(); ++s) {
+            bytes += textos.texto(s).size();
+            finTextos.push_back(bytes);
+        }
+
+        uint64_t posicion = sizeof(CabeceraCache);
+        for (int i = 0; i < CANTIDAD_SECCIONES; ++i) {
+            posicion = (posicion + 7) & ~uint64_t(7);
+            cabecera.desplazamientos[i] = posicion;
+            if (i == FIN_TEXTOS) {
+                cabecera.tamanos[i] = finTextos.size() * sizeof(uint64_t);
+            } else if (i == TEXTOS) {
+                cabecera.tamanos[i] = bytes;
+            } else {
+                std::fflush(temporales[i]);
+                cabecera.tamanos[i] = std::ftell(temporales[i]);
+            }
+            posicion += cabecera.tamanos[i];
+        }
+
+        std::string temporal = nombreCache(csv) + ".tmp";
+        std::ofstream salida(temporal, std::ios::binary | std::ios::trunc);
+        salida.write(reinterpret_cast<const char*>(&cabecera), sizeof(cabecera));
+        std::vector<char> copia(1 << 20);
+        for (int i = 0; i < CANTIDAD_SECCIONES && salida; ++i) {
+            static const char ceros[8] = {};
+            salida.write(ceros, cabecera.desplazamientos[i] - salida.tellp());
+            if (i == FIN_TEXTOS) {
+                salida.write(reinterpret_cast<const char*>(finTextos.data()), cabecera.tamanos[i]);
+            } else if (i == TEXTOS) {
+                for (Simbolo s = 0; s < textos.size(); ++s) {
+                    salida.write(textos.texto(s).data(), textos.texto(s).size());
+                }
+            } else {
+                std::rewind(temporales[i]);
+                size_t leidos;
+                while ((leidos = std::fread(copia.data(), 1, copia.size(), temporales[i])) > 0) {
+                    salida.write(copia.data(), leidos);
+                }
+            }
+        }
+        salida.close();
+        if (!salida || std::rename(temporal.c_str(), nombreCache(csv).c_str()) != 0) {
+            std::remove(temporal.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+// Lee la caché mapeada y entrega los mismos bloques que se armaron al
+// escribirla, con los registros ya convertidos: los textos son vistas al
+// diccionario mapeado, así que no se copia nada.
+class LectorCache {
+private:
+    const char* mapa = nullptr;
+    size_t tamano = 0;
+    CabeceraCache cabecera;
+    std::vector<size_t> hashes; // Hash de cada texto del diccionario
+    size_t bloqueActual = 0;
+
+    template <typename T>
+    const T* seccion(SeccionCache s) const {
+        return reinterpret_cast<const T*>(mapa + cabecera.desplazamientos[s]);
+    }
+
+    std::string_view texto(uint32_t indice) const {
+        const uint64_t* finTextos = seccion<uint64_t>(FIN_TEXTOS);
+        uint64_t inicio = indice == 0 ? 0 : finTextos[indice - 1];
+        return std::string_view(seccion<char>(TEXTOS) + inicio, finTextos[indice] - inicio);
+    }
+
+    // Comprueba que las secciones tengan el largo que dicen los contadores y
+    // que los fines e índices no apunten fuera de ellas; una caché dañada o
+    // de otra versión se descarta y se vuelve a leer el CSV
+    bool coherente() const {
+        auto largo = [&](SeccionCache s, uint64_t cantidad, uint64_t ancho) {
+            return cantidad <= tamano && cabecera.tamanos[s] == cantidad * ancho;
+        };
+        if (!largo(FIN_BLOQUES, cabecera.bloques, 8) || !largo(FIN_ERRORES, cabecera.bloques, 8)
+            || !largo(DIAS, cabecera.registros, 4) || !largo(TIENDAS, cabecera.registros, 4)
+            || !largo(PRODUCTOS, cabecera.registros, 4) || !largo(NOMBRES, cabecera.registros, 4)
+            || !largo(CANTIDADES, cabecera.registros, 8) || !largo(MONTOS, cabecera.registros, 8)
+            || !largo(ERRORES, cabecera.errores, 1) || !largo(MESES_ERRORES, cabecera.errores, 4)
+            || !largo(FIN_TEXTOS, cabecera.textos, 8)
+            || cabecera.textos > UINT32_MAX) {
+            return false;
+        }
+
+        const uint64_t* finBloques = seccion<uint64_t>(FIN_BLOQUES);
+        const uint64_t* finErrores = seccion<uint64_t>(FIN_ERRORES);
+        for (uint64_t i = 0; i < cabecera.bloques; ++i) {
+            if (finBloques[i] < (i == 0 ? 0 : finBloques[i - 1]) || finBloques[i] > cabecera.registros
+                || finErrores[i] < (i == 0 ? 0 : finErrores[i - 1]) || finErrores[i] > cabecera.errores) {
+                return false;
+            }
+        }
+        if (cabecera.bloques > 0 && (finBloques[cabecera.bloques - 1] != cabecera.registros
+                                     || finErrores[cabecera.bloques - 1] != cabecera.errores)) {
+            return false;
+        }
+
+        const uint64_t* finTextos = seccion<uint64_t>(FIN_TEXTOS);
+        for (uint64_t i = 0; i < cabecera.textos; ++i) {
+            if (finTextos[i] < (i == 0 ? 0 : finTextos[i - 1])) {
+                return false;
+            }
+        }
+        if ((cabecera.textos == 0 ? 0 : finTextos[cabecera.textos - 1]) != cabecera.tamanos[TEXTOS]) {
+            return false;
+        }
+
+        const int32_t* dias = seccion<int32_t>(DIAS);
+        const uint32_t* productos = seccion<uint32_t>(PRODUCTOS);
+        const uint32_t* nombres = seccion<uint32_t>(NOMBRES);
+        int32_t primerDia = diasDesdeEpoca(Fecha{ ANIO_MINIMO, 1, 1 });
+        int32_t ultimoDia = diasDesdeEpoca(Fecha{ ANIO_MAXIMO, 12, 31 });
+        for (uint64_t i = 0; i < cabecera.registros; ++i) {
+            if (productos[i] >= cabecera.textos || nombres[i] >= cabecera.textos || dias[i] < primerDia
+                || dias[i] > ultimoDia) {
+                return false;
+            }
+        }
+        const uint8_t* errores = seccion<uint8_t>(ERRORES);
+        for (uint64_t i = 0; i < cabecera.errores; ++i) {
+            if (errores[i] > static_cast<uint8_t>(EstadoRegistro::FueraDeRango)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void cerrar() {
+        if (mapa) {
+            munmap(const_cast<char*>(mapa), tamano);
+            mapa = nullptr;
+        }
+    }
 
 public:
-    void push(const Bloque& bloque) {
-        cola.push(bloque);
+    LectorCache() = default;
+    LectorCache(const LectorCache&) = delete;
+    LectorCache& operator=(const LectorCache&) = delete;
+
+    ~LectorCache() {
+        cerrar();
     }
 
-    bool pop(Bloque& bloque) {
-        if (cola.empty()) {
+    // Abre la caché si existe, corresponde a esta versión del CSV y a estas opciones
+    bool abrir(const std::string& csv, const OpcionesAgregacion& opciones) {
+        ClaveCsv clave;
+        if (!obtenerClaveCsv(csv, clave)) {
+            return false;
+        }
+        int fd = open(nombreCache(csv).c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(CabeceraCache)) {
+            close(fd);
+            return false;
+        }
+        void* direccion = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (direccion == MAP_FAILED) {
             return false;
         }
-        bloque = std::move(cola.front());
-        cola.pop();
+        mapa = static_cast<const char*>(direccion);
+        tamano = info.st_size;
+        std::memcpy(&cabecera, mapa, sizeof(cabecera));
+
+        bool valida = std::memcmp(cabecera.magia, MAGIA_CACHE, sizeof(MAGIA_CACHE)) == 0
+                   && cabecera.puntoFijo == opciones.puntoFijo && cabecera.diario == opciones.diario
+                   && cabecera.csv.tamano == clave.tamano && cabecera.csv.modificacionSeg == clave.modificacionSeg
+                   && cabecera.csv.modificacionNs == clave.modificacionNs && cabecera.csv.hash == clave.hash;
+        for (int i = 0; valida && i < CANTIDAD_SECCIONES; ++i) {
+            valida = cabecera.desplazamientos[i] % 8 == 0 && cabecera.desplazamientos[i] <= tamano
+                  && cabecera.tamanos[i] <= tamano - cabecera.desplazamientos[i];
+        }
+        if (!valida || !coherente()) {
+            cerrar();
+            return false;
+        }
+        madvise(direccion, tamano, MADV_SEQUENTIAL);
+        hashes.resize(cabecera.textos);
+        for (uint32_t i = 0; i < cabecera.textos; ++i) {
+            hashes[i] = hashIdentificador(texto(i));
+        }
         return true;
     }
 
-    bool empty() const {
-        return cola.empty();
+    bool quedanBloques() const {
+        return bloqueActual < cabecera.bloques;
     }
 
-    size_t size() const {
-        return cola.size();
+    // Bytes del CSV que representa la caché
+    uint64_t tamanoCsv() const {
+        return cabecera.csv.tamano;
     }
-};
-
-struct VentaMes {
-    bool ventasEnMes; // Indica si hubo ventas en este mes
-    double sumatoriaMontos; // Acumula el monto total de las ventas para este mes
-    int sumatoriaCantidades; // Acumula la cantidad total de productos vendidos para este mes
 
-    VentaMes() : ventasEnMes(false), sumatoriaMontos(0.0), sumatoriaCantidades(0) {}
-};
-
-struct VentaAnio {
-    int year; // Año al que pertenece este objeto
-    std::vector<VentaMes> ventasEnAnio; // Vector de ventas por mes
-
-    VentaAnio(int y) : year(y) {
-        ventasEnAnio.resize(12); // Inicializa con 12 meses
+    // Arma el siguiente bloque con sus registros y errores, sin los registros
+    // ni los errores fuera del rango de fechas de las opciones, y lo encola
+    void leerBloque(Cola& cola, Cola& libres, const OpcionesAgregacion& opciones) {
+        BloquePtr bloque;
+        if (libres.intentarPop(bloque)) {
+            bloque->reiniciar();
+        } else {
+            bloque = std::make_unique<Bloque>();
+        }
+        const uint64_t* finBloques = seccion<uint64_t>(FIN_BLOQUES);
+        const uint64_t* finErrores = seccion<uint64_t>(FIN_ERRORES);
+        uint64_t inicio = bloqueActual == 0 ? 0 : finBloques[bloqueActual - 1];
+        uint64_t inicioErrores = bloqueActual == 0 ? 0 : finErrores[bloqueActual - 1];
+
+        const int32_t* dias = seccion<int32_t>(DIAS);
+        const int32_t* tiendas = seccion<int32_t>(TIENDAS);
+        const uint32_t* productos = seccion<uint32_t>(PRODUCTOS);
+        const uint32_t* nombres = seccion<uint32_t>(NOMBRES);
+        const int64_t* cantidades = seccion<int64_t>(CANTIDADES);
+        const char* montos = seccion<char>(MONTOS);
+        bloque->registros.resize(finBloques[bloqueActual] - inicio);
+        size_t cantidad = 0;
+        for (uint64_t i = inicio; i < finBloques[bloqueActual]; ++i) {
+            RegistroCompra& registro = bloque->registros[cantidad];
+            registro.fecha = fechaDesdeDias(dias[i]);
+            if (!opciones.admiteMes(registro.fecha.anio * 12 + registro.fecha.mes - 1)) {
+                continue;
+            }
+            ++cantidad;
+            registro.numeroTienda = tiendas[i];
+            registro.identificadorProducto = texto(productos[i]);
+            registro.hashProducto = hashes[productos[i]];
+            registro.nombre = texto(nombres[i]);
+            registro.cantidad = cantidades[i];
+            if (cabecera.puntoFijo) {
+                std::memcpy(&registro.montoFijo, montos + i * 8, 8);
+            } else {
+                std::memcpy(&registro.monto, montos + i * 8, 8);
+            }
+        }
+        bloque->registros.resize(cantidad);
+        const uint8_t* errores = seccion<uint8_t>(ERRORES);
+        const int32_t* mesesErrores = seccion<int32_t>(MESES_ERRORES);
+        for (uint64_t i = inicioErrores; i < finErrores[bloqueActual]; ++i) {
+            // Como en convertirBloque, sólo se descartan los que tienen un mes legible fuera del rango
+            if (opciones.filtraFechas() && mesesErrores[i] >= 0 && !opciones.admiteMes(mesesErrores[i])) {
+                continue;
+            }
+            bloque->errores.push_back(static_cast<EstadoRegistro>(errores[i]));
+        }
+        bloque->numero = bloqueActual++;
+        cola.push(std::move(bloque));
     }
 };
 
-struct ProductoMapa {
-    std::string id; // Cambiado a std::string para representar el identificador como texto
-    std::vector<std::string> nombres;
-    std::vector<VentaAnio> ventasAnuales;
-
-    // Constructor con el identificador como std::string
-    ProductoMapa(const std::string& pid) : id(pid) {}
+// Estado guardado entre ejecuciones en pd.csv.estado: hasta qué byte de
+// pd.csv ya se agregó, un hash de la muestra de ese prefijo y los símbolos y
+// el mapa de productos de ese momento. Como pd.csv sólo crece por el final,
+// la siguiente ejecución valida el prefijo, carga el estado y procesa sólo
+// los registros agregados después.
+const char MAGIA_ESTADO[8] = { 'P', 'D', 'E', 'S', 'T', 'A', 'D', '3' };
+
+struct CabeceraEstado {
+    char magia[8];
+    uint32_t puntoFijo; // Opciones con las que se agregó; deben coincidir para retomar
+    uint32_t porTienda;
+    uint32_t diario;
+    uint32_t reservado;
+    uint64_t desplazamiento; // Bytes de pd.csv ya agregados, hasta el fin de un registro
+    uint64_t hash;           // hashMuestra de esos bytes
 };
 
-using MapaProductos = std::unordered_map<std::string, std::vector<ProductoMapa>>;
-
-struct Canasta {
-    std::string anio;
-    std::vector<std::string> nombres;
-    std::vector<std::string> ids;
-    std::array<double, 12> precios;  // Arreglo de 12 precios
+std::string nombreEstado(const std::string& csv) {
+    return csv + ".estado";
+}
 
-    // Constructor
-    Canasta(const std::string& a) : anio(a), precios{0} {}
+// Guarda el estado tras agregar los primeros "desplazamiento" bytes del CSV.
+// Sólo se guarda si terminan en un salto de línea: un último registro sin
+// terminar podría completarse después y se contaría dos veces.
+bool guardarEstado(const std::string& csv, uint64_t desplazamiento, const OpcionesAgregacion& opciones,
+                   const PoolSimbolos& simbolos, const MapaProductos& productos) {
+    CabeceraEstado cabecera{};
+    std::memcpy(cabecera.magia, MAGIA_ESTADO, sizeof(MAGIA_ESTADO));
+    cabecera.puntoFijo = opciones.puntoFijo;
+    cabecera.porTienda = opciones.porTienda;
+    cabecera.diario = opciones.diario;
+    cabecera.desplazamiento = desplazamiento;
+
+    if (!esArchivoRegular(csv)) {
+        return false;
+    }
+    int fd = open(csv.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    char ultimo = 0;
+    bool valido = desplazamiento > 0 && pread(fd, &ultimo, 1, desplazamiento - 1) == 1 && ultimo == '\n'
+               && hashMuestra(fd, desplazamiento, cabecera.hash);
+    close(fd);
+    if (!valido) {
+        return false;
+    }
 
-    // Método para agregar un nombre
-    void agregarNombre(const std::string& nombre) {
-        nombres.push_back(nombre);
+    std::string temporal = nombreEstado(csv) + ".tmp";
+    std::ofstream salida(temporal, std::ios::binary | std::ios::trunc);
+    escribirValor(salida, cabecera);
+    escribirValor(salida, uint64_t(simbolos.size()));
+    for (Simbolo s = 0; s < simbolos.size(); ++s) {
+        escribirValor(salida, uint32_t(simbolos.texto(s).size()));
+        salida.write(simbolos.texto(s).data(), simbolos.texto(s).size());
     }
+    productos.guardar(salida);
+    salida.close();
+    if (!salida || std::rename(temporal.c_str(), nombreEstado(csv).c_str()) != 0) {
+        std::remove(temporal.c_str());
+        return false;
+    }
+    return true;
+}
 
-    // Método para agregar un ID
-    void agregarId(const std::string& id) {
-        ids.push_back(id);
+// Carga el estado si fue guardado con las mismas opciones y el CSV todavía
+// empieza con los bytes que se agregaron; si no, deja símbolos y productos como estaban
+bool cargarEstado(const std::string& csv, const OpcionesAgregacion& opciones, PoolSimbolos& simbolos,
+                  MapaProductos& productos, uint64_t& desplazamiento) {
+    std::ifstream entrada(nombreEstado(csv), std::ios::binary);
+    CabeceraEstado cabecera;
+    if (!leerValor(entrada, cabecera) || std::memcmp(cabecera.magia, MAGIA_ESTADO, sizeof(MAGIA_ESTADO)) != 0
+        || cabecera.puntoFijo != opciones.puntoFijo || cabecera.porTienda != opciones.porTienda
+        || cabecera.diario != opciones.diario || !esArchivoRegular(csv)) {
+        return false;
     }
 
-    // Método para establecer el precio de un mes específico
-    void setPrecio(int mes, double precio) {
-        if (mes >= 0 && mes < 12) {
-            precios[mes] = precio;
-        }
+    int fd = open(csv.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    uint64_t hash = 0;
+    bool prefijo = fstat(fd, &info) == 0 && uint64_t(info.st_size) >= cabecera.desplazamiento
+                && hashMuestra(fd, cabecera.desplazamiento, hash) && hash == cabecera.hash;
+    close(fd);
+    if (!prefijo) {
+        return false;
     }
 
-    // Método para obtener el precio de un mes específico
-    double getPrecio(int mes) const {
-        if (mes >= 0 && mes < 12) {
-            return precios[mes];
+    PoolSimbolos simbolosGuardados;
+    MapaProductos productosGuardados(opciones);
+    uint64_t cantidad;
+    if (!leerValor(entrada, cantidad)) {
+        return false;
+    }
+    std::string texto;
+    for (uint64_t i = 0; i < cantidad; ++i) {
+        uint32_t largo;
+        if (!leerValor(entrada, largo)) {
+            return false;
+        }
+        texto.resize(largo);
+        if (!entrada.read(&texto[0], largo) || simbolosGuardados.internar(texto) != i) {
+            return false;
         }
-        return 0.0;  // Retorna 0 si el mes es inválido
     }
-};
-
-Fecha obtenerFecha(const std::vector<std::string>& campos) {
-    std::string fechaCompleta = campos[0];
-    int anio, mes, dia;
-    char delim;
-    std::stringstream ss(fechaCompleta);
-    ss >> anio >> delim >> mes >> delim >> dia;
-    return { anio, mes, dia };
+    if (!productosGuardados.cargar(entrada, simbolosGuardados.size())) {
+        return false;
+    }
+    simbolos = std::move(simbolosGuardados);
+    productos = std::move(productosGuardados);
+    desplazamiento = cabecera.desplazamiento;
+    return true;
 }
 
-RegistroCompra procesarRegistro(const std::vector<std::string>& campos) {
-    RegistroCompra registro;
-    registro.fecha = obtenerFecha(campos);
-    registro.identificadorProducto = campos[6];
-    registro.nombre = campos[8];
+// Índice disperso de pd.csv por mes, en pd.csv.indice. El archivo se parte
+// en zonas de unos TAMANO_ZONA bytes que empiezan y terminan en límites de
+// registro, y de cada una se guarda el primer y el último mes (anio * 12 +
+// mes - 1) según el prefijo de sus líneas. Los meses de un rango se buscan en
+// las zonas que los cubren: en un archivo ordenado por fecha son pocas y
+// contiguas; en uno desordenado casi todas. Una zona con alguna línea sin el
+// prefijo esperado cubre todos los meses. Vale para la versión del CSV de su ClaveCsv.
+const size_t TAMANO_ZONA = 256 * 1024;
+
+const char MAGIA_INDICE[8] = { 'P', 'D', 'I', 'N', 'D', 'I', 'C', '1' };
+
+struct ZonaIndice {
+    uint64_t inicio;
+    uint64_t fin;
+    int32_t mesMinimo;
+    int32_t mesMaximo;
+};
 
-    try {
-        registro.numeroTienda = std::stoi(campos[2]);
-        registro.cantidad = std::stoi(campos[7]);
-        registro.monto = std::stod(campos[9]);
-    } catch (const std::invalid_argument& e) {
-        throw std::runtime_error("Error de conversión en algún campo.");
-    } catch (const std::out_of_range& e) {
-        throw std::runtime_error("Valor fuera de rango en algún campo numérico.");
-    }
+struct CabeceraIndice {
+    char magia[8];
+    ClaveCsv csv;
+    uint64_t zonas;
+};
 
-    return registro;
+std::string nombreIndice(const std::string& csv) {
+    return csv + ".indice";
 }
 
-
-std::vector<std::string> procesarLinea(const std::string& linea) {
-    std::vector<std::string> campos;
-    std::string campo = "";
-    bool dentroDeCampo = false;
-    int contadorComillas = 0;
-    bool campoFinalizado = false;
-
-    for (char c : linea) {
-        if (c == '"') {
-            contadorComillas++;
-            dentroDeCampo = !dentroDeCampo;
-            if (contadorComillas % 2 == 0) {
-                campos.push_back(campo);
-                campoFinalizado = false;
-                campo = "";
-            }
-        } else if (c == ';' && !dentroDeCampo) {
-            if (campoFinalizado == true) {
-                campos.push_back(campo);
-            }
-            campoFinalizado = true;
-            campo = "";
-        } else {
-            campo += c;
+class IndiceMeses {
+private:
+    std::vector<ZonaIndice> zonas;
+
+    // Zonas de un tramo del mapeo; la última termina donde termina el tramo
+    static void zonasDeTramo(std::string_view contenido, size_t inicio, size_t fin, std::vector<ZonaIndice>& salida) {
+        std::vector<std::string_view> lineas;
+        separarRegistros(contenido.substr(inicio, fin - inicio), lineas);
+        ZonaIndice zona{ inicio, fin, INT_MAX, -1 };
+        for (std::string_view linea : lineas) {
+            size_t desplazamiento = linea.data() - contenido.data();
+            if (desplazamiento - zona.inicio >= TAMANO_ZONA) {
+                zona.fin = desplazamiento;
+                salida.push_back(zona);
+                zona = ZonaIndice{ desplazamiento, fin, INT_MAX, -1 };
+            }
+            int mes = mesDelPrefijo(linea);
+            if (mes < 0) {
+                mes = 0;
+                zona.mesMaximo = INT_MAX;
+            }
+            zona.mesMinimo = std::min(zona.mesMinimo, mes);
+            zona.mesMaximo = std::max(zona.mesMaximo, mes);
         }
+        zona.fin = fin;
+        salida.push_back(zona);
     }
 
-    if (!campo.empty() && campoFinalizado) {
-        campos.push_back(campo);
-    }
-
-    for (auto& c : campos) {
-        if (!c.empty() && c.front() == '"' && c.back() == '"') {
-            c = c.substr(1, c.length() - 2);
+public:
+    // Recorre el CSV mapeado, sin separar campos, con todos los hilos de OpenMP
+    bool construir(const std::string& csv) {
+        LectorBloques lector(csv, true);
+        if (!lector.mapeado()) {
+            return false;
+        }
+        lector.descartarPrimeraLinea();
+        std::string_view contenido = lector.contenido();
+        std::vector<size_t> tramos = dividirEnTramos(contenido.data(), lector.posicion(), contenido.size(), TAMANO_TRAMO);
+        std::vector<std::vector<ZonaIndice>> porTramo(tramos.size() - 1);
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < porTramo.size(); ++i) {
+            if (tramos[i] < tramos[i + 1]) {
+                zonasDeTramo(contenido, tramos[i], tramos[i + 1], porTramo[i]);
+            }
         }
-        if (c.empty() || std::all_of(c.begin(), c.end(), isspace)) {
-            c = "";
+        zonas.clear();
+        for (const auto& parte : porTramo) {
+            zonas.insert(zonas.end(), parte.begin(), parte.end());
         }
+        return true;
     }
 
-    return campos;
-}
-
-bool quedanLineasPorLeer(const std::string& nombre_archivo, std::streampos posicion_actual) {
-    std::ifstream archivo(nombre_archivo);
-    std::string linea;
-
-    if (archivo.is_open()) {
-        archivo.seekg(posicion_actual); // Mover la posición del archivo a la posición actual
-
-        // Intentar leer una línea para verificar si quedan líneas por leer
-        if (std::getline(archivo, linea)) {
-            archivo.close();
-            return true; // Quedan líneas por leer
+    bool guardar(const std::string& csv, const ClaveCsv& clave) const {
+        CabeceraIndice cabecera{};
+        std::memcpy(cabecera.magia, MAGIA_INDICE, sizeof(MAGIA_INDICE));
+        cabecera.csv = clave;
+        cabecera.zonas = zonas.size();
+        std::string temporal = nombreIndice(csv) + ".tmp";
+        std::ofstream salida(temporal, std::ios::binary | std::ios::trunc);
+        escribirValor(salida, cabecera);
+        salida.write(reinterpret_cast<const char*>(zonas.data()), zonas.size() * sizeof(ZonaIndice));
+        salida.close();
+        if (!salida || std::rename(temporal.c_str(), nombreIndice(csv).c_str()) != 0) {
+            std::remove(temporal.c_str());
+            return false;
         }
-
-        archivo.close();
-    } else {
-        std::cerr << "No se pudo abrir el archivo" << std::endl;
+        return true;
     }
 
-    return false; // No quedan líneas por leer o error al abrir el archivo
-}
-
-void leerCSV(const std::string& nombre_archivo, Cola& cola, int tamano_bloque, std::streampos& posicion_actual) {
-    std::ifstream archivo(nombre_archivo);
-    std::string linea;
-    Bloque bloque_actual;
+    // Carga el índice si corresponde a esta versión del CSV
+    bool cargar(const std::string& csv, const ClaveCsv& clave) {
+        std::ifstream entrada(nombreIndice(csv), std::ios::binary);
+        CabeceraIndice cabecera;
+        if (!leerValor(entrada, cabecera) || std::memcmp(cabecera.magia, MAGIA_INDICE, sizeof(MAGIA_INDICE)) != 0
+            || cabecera.csv.tamano != clave.tamano || cabecera.csv.modificacionSeg != clave.modificacionSeg
+            || cabecera.csv.modificacionNs != clave.modificacionNs || cabecera.csv.hash != clave.hash) {
+            return false;
+        }
+        zonas.clear();
+        for (uint64_t i = 0; i < cabecera.zonas; ++i) {
+            ZonaIndice zona;
+            if (!leerValor(entrada, zona) || zona.inicio > zona.fin || zona.fin > clave.tamano) {
+                return false;
+            }
+            zonas.push_back(zona);
+        }
+        return true;
+    }
 
-    if (archivo.is_open()) {
-        archivo.seekg(posicion_actual); // Mover la posición del archivo a la posición actual guardada
+    size_t size() const {
+        return zonas.size();
+    }
 
-        while (std::getline(archivo, linea) && bloque_actual.lineas.size() < tamano_bloque) {
-            if (std::count(linea.begin(), linea.end(), '"') % 2 != 0) {
-                std::string linea_siguiente;
-                if (std::getline(archivo, linea_siguiente)) {
-                    linea += linea_siguiente;
-                }
+    // Rangos del archivo con las zonas que pueden tener registros de esos
+    // meses; las zonas contiguas se unen hasta unos TAMANO_TRAMO bytes, que es
+    // lo que procesa un hilo como un bloque
+    std::vector<std::pair<size_t, size_t>> rangos(const OpcionesAgregacion& opciones) const {
+        std::vector<std::pair<size_t, size_t>> resultado;
+        for (const ZonaIndice& zona : zonas) {
+            if (zona.mesMaximo < opciones.mesDesde || zona.mesMinimo > opciones.mesHasta) {
+                continue;
+            }
+            if (!resultado.empty() && resultado.back().second == zona.inicio
+                && zona.fin - resultado.back().first <= TAMANO_TRAMO) {
+                resultado.back().second = zona.fin;
+            } else {
+                resultado.emplace_back(zona.inicio, zona.fin);
             }
-
-            bloque_actual.lineas.push_back(linea);
         }
+        return resultado;
+    }
+};
 
-        if (!bloque_actual.lineas.empty()) {
-            cola.push(bloque_actual);
+// Función para procesar un bloque de datos ya convertido. Acumula en un mapa
+// parcial propio del hilo, con sus símbolos en un pool también propio, que
+// luego se fusiona con fusionarParcial.
+void procesarBloque(const Bloque& bloque, MapaProductos& parcial, PoolSimbolos& simbolosParcial) {
+    for (const auto& registro : bloque.registros) {
+        Simbolo id = simbolosParcial.internar(registro.identificadorProducto, registro.hashProducto);
+        uint32_t indice = parcial.buscarOCrear(id);
+        parcial[indice].nombres.agregar(simbolosParcial.internar(registro.nombre));
+
+        // Las ventas van al año del producto, con cualquiera de sus nombres
+        if (VentasDispersas* tiendas = parcial.ventasPorTienda()) {
+            uint32_t fila = tiendas->buscarOCrear(indice, registro.numeroTienda, registro.fecha.anio);
+            tiendas->sumar(fila, registro.fecha.mes - 1, registro.monto, registro.montoFijo, registro.cantidad);
+        } else {
+            parcial.ventas().sumar(indice, registro.fecha.anio, registro.fecha.mes - 1, registro.monto, registro.montoFijo,
+                                   registro.cantidad);
         }
-
-        posicion_actual = archivo.tellg(); // Actualizar la posición actual del archivo
-
-        archivo.close();
-    } else {
-        std::cerr << "No se pudo abrir el archivo" << std::endl;
+        if (VentasDispersas* diario = parcial.ventasDiarias()) {
+            uint32_t fila = diario->buscarOCrear(indice, TODAS_LAS_TIENDAS, registro.fecha.anio);
+            diario->sumar(fila, diaDelAnio(registro.fecha.mes, registro.fecha.dia), registro.monto, registro.montoFijo,
+                          registro.cantidad);
+        }
+    }
+    // Por tienda, la vista por producto se obtiene sumando las tiendas del bloque
+    if (const VentasDispersas* tiendas = parcial.ventasPorTienda()) {
+        tiendas->acumularEnProductos(parcial.ventas());
     }
 }
 
-void descartarPrimeraLinea(const std::string& nombre_archivo, std::streampos& posicion_actual) {
-    std::ifstream archivo(nombre_archivo);
-    std::string linea;
-    if (archivo.is_open()) {
-        archivo.seekg(posicion_actual); // Mover la posición del archivo a la posición actual guardada
-        std::getline(archivo, linea);
-        posicion_actual = archivo.tellg(); // Actualizar la posición actual del archivo
-        archivo.close();
-    } else {
-        std::cerr << "No se pudo abrir el archivo" << std::endl;
+void reportarErrores(const Bloque& bloque) {
+    for (EstadoRegistro estado : bloque.errores) {
+        std::cerr << "Error al procesar registro: " << describirEstado(estado) << std::endl;
     }
 }
-// Función para procesar un bloque de datos
-void procesarBloque(const Bloque& bloque, MapaProductos& productos, MapaProductos& canasta) {
-    for (const auto& linea : bloque.lineas) {
-        std::vector<std::string> campos = procesarLinea(linea);
-        RegistroCompra registro;
-        try {
-            registro = procesarRegistro(campos);
-        } catch (const std::runtime_error& e) {
-            std::cerr << "Error al procesar registro: " << e.what() << std::endl;
-            continue; // Salta este registro y pasa al siguiente
-        }
-        // Organización por año
-        int anio = registro.fecha.anio;
-
-        // Crear la clave para el producto (considerando colisiones)
-        std::string key = registro.identificadorProducto;
-
-        // Buscar el producto en el vector correspondiente al año
-        bool encontrado = false;
-        for (auto& producto : productos[key]) {
-            if (producto.id == registro.identificadorProducto) {
-                // Producto encontrado, buscar el nombre correspondiente
-                for (size_t i = 0; i < producto.nombres.size(); ++i) {
-                    if (producto.nombres[i] == registro.nombre) {
-                        // Nombre encontrado, buscar el año correspondiente
-                        for (auto& ventaAnio : producto.ventasAnuales) {
-                            if (ventaAnio.year == anio) {
-                                // Año encontrado, actualizar ventas mensuales
-                                int mes = registro.fecha.mes - 1; // Meses de 0 a 11 en el arreglo
-                                ventaAnio.ventasEnAnio[mes].ventasEnMes = true;
-                                ventaAnio.ventasEnAnio[mes].sumatoriaMontos += registro.monto;
-                                ventaAnio.ventasEnAnio[mes].sumatoriaCantidades += registro.cantidad;
-                                ///////////////inyeccion de verificacion
-                                bool todosLosMesesConVentas = true;
-                                for (int mes = 0; mes < 11; ++mes) {
-                                    if (!ventaAnio.ventasEnAnio[mes].ventasEnMes) {
-                                        todosLosMesesConVentas = false; // Si encontramos un mes sin ventas, retornamos false
-                                    }
-                                }
-                                if (todosLosMesesConVentas == true) {
-                                    // Copiar el producto al mapa canasta
-                                    std::string key = registro.identificadorProducto;
-                                    
-                                    // Buscar el producto en el mapa de origen (productos)
-                                    auto it = std::find_if(productos[key].begin(), productos[key].end(),
-                                        [&registro](const ProductoMapa& p) { return p.id == registro.identificadorProducto; });
-                                    
-                                    if (it != productos[key].end()) {
-                                        // Producto encontrado, crear una copia
-                                        ProductoMapa productoCopiado = *it;
-                                        
-                                        // Buscar si ya existe en el mapa de destino (canasta)
-                                        auto it_canasta = std::find_if(canasta[key].begin(), canasta[key].end(),
-                                            [&registro](const ProductoMapa& p) { return p.id == registro.identificadorProducto; });
-                                        
-                                        if (it_canasta != canasta[key].end()) {
-                                            // Si ya existe, actualizarlo
-                                            *it_canasta = productoCopiado;
-                                        } else {
-                                            // Si no existe, agregarlo
-                                            canasta[key].push_back(productoCopiado);
-                                        }
-                                    }
-                                }
-                                encontrado = true;
-                                break;
-                            }
-                        }
-                        if (!encontrado) {
-                            // Año no encontrado, agregar nuevo año de ventas
-                            VentaAnio nuevaVentaAnio(anio);
-                            int mes = registro.fecha.mes - 1; // Meses de 0 a 11 en el arreglo
-                            nuevaVentaAnio.ventasEnAnio[mes].ventasEnMes = true;
-                            nuevaVentaAnio.ventasEnAnio[mes].sumatoriaMontos += registro.monto;
-                            nuevaVentaAnio.ventasEnAnio[mes].sumatoriaCantidades += registro.cantidad;
-                            producto.ventasAnuales.push_back(nuevaVentaAnio);
-                            encontrado = true;
-                        }
-                        break;
-                    }
-                }
-                if (!encontrado) {
-                    // Nombre no encontrado, agregar nuevo nombre y año de ventas
-                    producto.nombres.push_back(registro.nombre);
-                    VentaAnio nuevaVentaAnio(anio);
-                    int mes = registro.fecha.mes - 1; // Meses de 0 a 11 en el arreglo
-                    nuevaVentaAnio.ventasEnAnio[mes].ventasEnMes = true;
-                    nuevaVentaAnio.ventasEnAnio[mes].sumatoriaMontos += registro.monto;
-                    nuevaVentaAnio.ventasEnAnio[mes].sumatoriaCantidades += registro.cantidad;
-                    producto.ventasAnuales.push_back(nuevaVentaAnio);
-                    encontrado = true;
-                }
-                break;
-            }
-        }
 
-        if (!encontrado) {
-            // Producto no encontrado, crear nuevo producto y añadir nombre y año de ventas
-            ProductoMapa nuevoProducto(registro.identificadorProducto);
-            nuevoProducto.nombres.push_back(registro.nombre);
-            VentaAnio nuevaVentaAnio(anio);
-            int mes = registro.fecha.mes - 1; // Meses de 0 a 11 en el arreglo
-            nuevaVentaAnio.ventasEnAnio[mes].ventasEnMes = true;
-            nuevaVentaAnio.ventasEnAnio[mes].sumatoriaMontos += registro.monto;
-            nuevaVentaAnio.ventasEnAnio[mes].sumatoriaCantidades += registro.cantidad;
-            nuevoProducto.ventasAnuales.push_back(nuevaVentaAnio);
-            productos[key].push_back(nuevoProducto);
+// Suma un mapa parcial al mapa completo. Los parciales deben fusionarse en el
+// orden de sus bloques: así cada total es la suma, bloque por bloque, de las
+// sumas parciales, y el resultado es idéntico con cualquier cantidad de hilos.
+// Los símbolos del parcial se traducen al pool global una vez por producto.
+void fusionarParcial(MapaProductos& productos, PoolSimbolos& simbolos, const MapaProductos& parcial,
+                     const PoolSimbolos& simbolosParcial) {
+    const CuboVentas& ventasParcial = parcial.ventas();
+    CuboVentas& ventas = productos.ventas();
+    std::vector<uint32_t> indices; // Índice en el mapa completo de cada producto del parcial
+    indices.reserve(parcial.size());
+    for (size_t indiceParcial = 0; indiceParcial < parcial.size(); ++indiceParcial) {
+        const ProductoMapa& productoParcial = parcial[indiceParcial];
+        Simbolo id = simbolos.internar(simbolosParcial.texto(productoParcial.id), simbolosParcial.hash(productoParcial.id));
+        uint32_t indice = productos.buscarOCrear(id);
+        for (const VarianteNombre& variante : productoParcial.nombres) {
+            Simbolo nombre = simbolos.internar(simbolosParcial.texto(variante.nombre), simbolosParcial.hash(variante.nombre));
+            productos[indice].nombres.agregar(nombre, variante.ocurrencias);
         }
+        ventas.sumarFila(indice, ventasParcial, indiceParcial);
+        indices.push_back(indice);
+    }
+    if (VentasDispersas* tiendas = productos.ventasPorTienda()) {
+        tiendas->fusionar(*parcial.ventasPorTienda(), indices);
+    }
+    if (VentasDispersas* diario = productos.ventasDiarias()) {
+        diario->fusionar(*parcial.ventasDiarias(), indices);
     }
 }
 
-void imprimirCanastaBasica(const MapaProductos& productos, int year) {
+// Turnos para acumular en el orden del archivo los bloques convertidos en paralelo
+class Turnos {
+private:
+    std::mutex mutex;
+    std::condition_variable cambio;
+    size_t siguiente = 0;
+
+public:
+    void esperar(size_t numero) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cambio.wait(lock, [this, numero] { return siguiente == numero; });
+    }
+
+    void avanzar() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++siguiente;
+        }
+        cambio.notify_all();
+    }
+};
+
+void imprimirCanastaBasica(const MapaProductos& productos, const PoolSimbolos& simbolos, int year) {
     std::cout << "Canasta básica del año " << year << std::endl;
 
     // Contadores para el total de productos y sumas para cálculo de promedio
     int totalProductos = 0;
     std::vector<double> sumatoriaMontos(12, 0.0); // Suma de montos por mes
-    std::vector<int> sumatoriaCantidades(12, 0);  // Suma de cantidades por mes
-    std::vector<bool> productoPresenteEnMes(12, true); // Indica si el producto está presente en cada mes
+    std::vector<int64_t> sumatoriaCantidades(12, 0);  // Suma de cantidades por mes
+    const CuboVentas& ventas = productos.ventas();
+    int desplazamiento = year - ventas.primerAnio();
+    if (desplazamiento < 0 || desplazamiento >= ventas.anios()) {
+        return; // Ningún producto tiene ventas ese año
+    }
 
     // Recorrer el mapa de productos
-    for (const auto& pair : productos) {
-        const std::vector<ProductoMapa>& productosLista = pair.second;
+    for (size_t indice = 0; indice < productos.size(); ++indice) {
+        const ProductoMapa& producto = productos[indice];
+        totalProductos++;
+
+        // Sumar los meses con ventas del año deseado
+        uint64_t mascara = ventas.mascara(indice, desplazamiento);
+        const int64_t* cantidades = ventas.cantidadesDe(indice, desplazamiento);
+        for (int mes = 0; mes < 12; ++mes) {
+            if (mascara & (1 << mes)) {
+                sumatoriaMontos[mes] += ventas.monto(indice, desplazamiento, mes);
+                sumatoriaCantidades[mes] += cantidades[mes];
+            }
+        }
 
-        for (const ProductoMapa& producto : productosLista) {
-            totalProductos++;
+        // Verificar si el producto está presente en todos los meses
+        bool productoEnCanasta = mascara == CuboVentas::TODOS_LOS_MESES;
 
-            // Reiniciar la bandera de presencia del producto en todos los meses
+        // Si el producto está en todos los meses, imprimir información
+        if (productoEnCanasta) {
+            std::cout << "Producto ID: " << simbolos.texto(producto.id) << std::endl;
+            std::cout << "Cantidad: " << producto.nombres.size() << std::endl;
+
+            // Imprimir el costo unitario promedio por mes
             for (int mes = 0; mes < 12; ++mes) {
-                productoPresenteEnMes[mes] = false;
-            }
-
-            // Recorrer ventas por año para encontrar el año deseado
-            for (const VentaAnio& ventaAnio : producto.ventasAnuales) {
-                if (ventaAnio.year == year) {
-                    // Recorrer ventas por mes
-                    for (int mes = 0; mes < 12; ++mes) {
-                        const VentaMes& ventaMes = ventaAnio.ventasEnAnio[mes];
-                        if (ventaMes.ventasEnMes) {
-                            sumatoriaMontos[mes] += ventaMes.sumatoriaMontos;
-                            sumatoriaCantidades[mes] += ventaMes.sumatoriaCantidades;
-                            productoPresenteEnMes[mes] = true;
-                        }
-                    }
-                    break; // Salir del bucle de ventas anuales una vez encontrado el año deseado
+                if (sumatoriaCantidades[mes] > 0) {
+                    double precioPromedio = sumatoriaMontos[mes] / sumatoriaCantidades[mes];
+                    std::cout << "Mes: " << mes + 1 << std::endl;
+                    std::cout << "Costo unitario promedio: " << std::fixed << std::setprecision(2) << precioPromedio << std::endl;
                 }
             }
 
-            // Verificar si el producto está presente en todos los meses
-            bool productoEnCanasta = true;
+            std::cout << std::endl; // Separador entre productos
+        }
+    }
+}
+
+void imprimirMapa(const MapaProductos& mapa, const PoolSimbolos& simbolos) {
+    const CuboVentas& ventas = mapa.ventas();
+    for (size_t indice = 0; indice < mapa.size(); ++indice) {
+        const ProductoMapa& producto = mapa[indice];
+        std::cout << "Producto ID: " << simbolos.texto(producto.id) << std::endl;
+
+        if (!producto.nombres.empty()) {
+            std::cout << "  Nombres:";
+            for (const VarianteNombre& variante : producto.nombres) {
+                std::cout << " " << simbolos.texto(variante.nombre) << " (" << variante.ocurrencias << ")";
+            }
+            std::cout << std::endl;
+        }
+
+        for (int desplazamiento = 0; desplazamiento < ventas.anios(); ++desplazamiento) {
+            uint64_t mascara = ventas.mascara(indice, desplazamiento);
+            if (mascara == 0) {
+                continue;
+            }
+            std::cout << "  Año: " << ventas.primerAnio() + desplazamiento << std::endl;
+            const int64_t* cantidades = ventas.cantidadesDe(indice, desplazamiento);
             for (int mes = 0; mes < 12; ++mes) {
-                if (!productoPresenteEnMes[mes]) {
-                    productoEnCanasta = false;
-                    break;
+                if (mascara & (1 << mes)) {
+                    std::cout << "    Mes " << mes + 1 << ": "
+                              << "Monto: " << std::fixed << std::setprecision(2) << ventas.monto(indice, desplazamiento, mes)
+                              << ", Cantidad: " << cantidades[mes] << std::endl;
                 }
             }
+        }
+        std::cout << std::endl;
+    }
+}
 
-            // Si el producto está en todos los meses, imprimir información
-            if (productoEnCanasta) {
-                std::cout << "Producto ID: " << producto.id << std::endl;
-                std::cout << "Cantidad: " << producto.nombres.size() << std::endl;
+// Los totales por mes y por semana de las ventas diarias no se guardan: se
+// calculan al pedirlos, agrupando los días de un producto en todos sus años.
+// Los años con ventas diarias son los del cubo mensual.
+template <typename Grupo>
+CuboVentas resumirDiario(const MapaProductos& mapa, size_t producto, int periodos, Grupo grupo) {
+    const VentasDispersas& diario = *mapa.ventasDiarias();
+    const CuboVentas& ventas = mapa.ventas();
+    CuboVentas resumen(diario.enPuntoFijo(), periodos);
+    resumen.agregarProducto();
+    for (int desplazamiento = 0; desplazamiento < ventas.anios(); ++desplazamiento) {
+        uint32_t fila = diario.buscar(producto, TODAS_LAS_TIENDAS, ventas.primerAnio() + desplazamiento);
+        if (fila != VentasDispersas::NO_ENCONTRADA) {
+            diario.sumarAgrupado(resumen, 0, fila, grupo);
+        }
+    }
+    return resumen;
+}
 
-                // Imprimir el costo unitario promedio por mes
-                for (int mes = 0; mes < 12; ++mes) {
-                    if (sumatoriaCantidades[mes] > 0) {
-                        double precioPromedio = sumatoriaMontos[mes] / sumatoriaCantidades[mes];
-                        std::cout << "Mes: " << mes + 1 << std::endl;
-                        std::cout << "Costo unitario promedio: " << std::fixed << std::setprecision(2) << precioPromedio << std::endl;
-                    }
-                }
+CuboVentas resumirPorMes(const MapaProductos& mapa, size_t producto) {
+    return resumirDiario(mapa, producto, 12, [](int, int dia) { return mesDelDia(dia); });
+}
+
+CuboVentas resumirPorSemana(const MapaProductos& mapa, size_t producto) {
+    return resumirDiario(mapa, producto, SEMANAS_POR_ANIO, [](int anio, int dia) { return semanaDelDia(anio, dia); });
+}
 
-                std::cout << std::endl; // Separador entre productos
+// Escribe las ventas semanales y mensuales de un producto a partir de las
+// ventas diarias. Sin std::endl: se llama una vez por producto sobre un archivo.
+void imprimirResumenDiario(std::ostream& salida, const MapaProductos& mapa, const PoolSimbolos& simbolos, size_t indice) {
+    if (!mapa.ventasDiarias()) {
+        return;
+    }
+    salida << "Producto ID: " << simbolos.texto(mapa[indice].id) << '\n';
+    const char* etiquetas[2] = { "Semana", "Mes" };
+    CuboVentas resumenes[2] = { resumirPorSemana(mapa, indice), resumirPorMes(mapa, indice) };
+    for (int r = 0; r < 2; ++r) {
+        const CuboVentas& resumen = resumenes[r];
+        for (int desplazamiento = 0; desplazamiento < resumen.anios(); ++desplazamiento) {
+            if (!resumen.anioConVentas(0, desplazamiento)) {
+                continue;
+            }
+            salida << "  Año: " << resumen.primerAnio() + desplazamiento << '\n';
+            const int64_t* cantidades = resumen.cantidadesDe(0, desplazamiento);
+            for (int p = 0; p < resumen.periodosPorAnio(); ++p) {
+                if (resumen.conVentas(0, desplazamiento, p)) {
+                    salida << "    " << etiquetas[r] << " " << p + 1 << ": "
+                           << "Monto: " << std::fixed << std::setprecision(2) << resumen.monto(0, desplazamiento, p)
+                           << ", Cantidad: " << cantidades[p] << '\n';
+                }
             }
         }
     }
+    salida << '\n';
 }
 
-void imprimirMapa(const MapaProductos& mapa) {
-    for (const auto& [categoria, productos] : mapa) {
-        std::cout << "Categoría id: " << categoria << std::endl;
-        
-        for (const auto& producto : productos) {
-            std::cout << "  Producto ID: " << producto.id << std::endl;
-            
-            if (!producto.nombres.empty()) {
-                std::cout << "    Nombres:";
-                for (const auto& nombre : producto.nombres) {
-                    std::cout << " " << nombre;
-                }
-                std::cout << std::endl;
-            }
-            
-            for (const auto& ventaAnio : producto.ventasAnuales) {
-                std::cout << "    Año: " << ventaAnio.year << std::endl;
-                for (int mes = 0; mes < 12; ++mes) {
-                    const auto& ventaMes = ventaAnio.ventasEnAnio[mes];
-                    if (ventaMes.ventasEnMes) {
-                        std::cout << "      Mes " << mes + 1 << ": "
-                                  << "Monto: " << std::fixed << std::setprecision(2) << ventaMes.sumatoriaMontos
-                                  << ", Cantidad: " << ventaMes.sumatoriaCantidades << std::endl;
-                    }
-                }
+// Guarda en resumen_diario.txt los totales semanales y mensuales de cada producto
+void guardarResumenDiario(const MapaProductos& mapa, const PoolSimbolos& simbolos) {
+    std::ofstream archivo("resumen_diario.txt");
+    if (!archivo.is_open()) {
+        std::cout << "Error al abrir el archivo resumen_diario.txt." << std::endl;
+        return;
+    }
+    for (size_t indice = 0; indice < mapa.size(); ++indice) {
+        imprimirResumenDiario(archivo, mapa, simbolos, indice);
+    }
+    std::cout << "Resumen semanal y mensual guardado en resumen_diario.txt." << std::endl;
+}
+
+// Monto vendido cada día del año por los productos de una canasta, para
+// ponderar la paridad diaria. Vacío si no se agregó por día.
+std::vector<double> pesosDiariosCanasta(const MapaProductos& mapa, const Canasta& canasta) {
+    const VentasDispersas* diario = mapa.ventasDiarias();
+    if (!diario) {
+        return {};
+    }
+    std::vector<double> pesos(DIAS_POR_ANIO, 0.0);
+    for (Simbolo id : canasta.ids) {
+        uint32_t fila = diario->buscar(mapa.buscar(id), TODAS_LAS_TIENDAS, canasta.anio);
+        if (fila == VentasDispersas::NO_ENCONTRADA) {
+            continue;
+        }
+        for (int dia = 0; dia < DIAS_POR_ANIO; ++dia) {
+            if (diario->conVentas(fila, dia)) {
+                pesos[dia] += diario->monto(fila, dia);
             }
-            std::cout << std::endl;
         }
-        std::cout << std::endl;
     }
+    return pesos;
 }
 
+// Arma las canastas con el mapa completo, una vez terminada la lectura: un
+// producto entra en la canasta de un año si tuvo ventas en los 12 meses.
 void procesarMapaYCanastas(const MapaProductos& mapa, std::vector<Canasta>& canastas) {
-    for (const auto& [categoria, productos] : mapa) {
-        for (const auto& producto : productos) {
-            for (const auto& ventaAnio : producto.ventasAnuales) {
-                // Verificar si todos los meses tienen ventas
-                bool todosLosMesesConVentas = true;
-                for (int mes = 0; mes < 12; ++mes) {
-                    if (!ventaAnio.ventasEnAnio[mes].ventasEnMes) {
-                        todosLosMesesConVentas = false;
-                        break;
-                    }
-                }
+    const CuboVentas& ventas = mapa.ventas();
+
+    // Posición en "canastas" de la canasta de cada año del cubo, o -1
+    std::vector<int> canastaPorAnio(ventas.anios(), -1);
+    for (size_t i = 0; i < canastas.size(); ++i) {
+        int desplazamiento = canastas[i].anio - ventas.primerAnio();
+        if (desplazamiento >= 0 && desplazamiento < ventas.anios()) {
+            canastaPorAnio[desplazamiento] = static_cast<int>(i);
+        }
+    }
 
-                if (todosLosMesesConVentas) {
-                    // Buscar o crear la canasta para este año
-                    auto it = std::find_if(canastas.begin(), canastas.end(),
-                        [&ventaAnio](const Canasta& c) { return c.anio == std::to_string(ventaAnio.year); });
-
-                    Canasta* canasta;
-                    if (it == canastas.end()) {
-                        // Crear nueva canasta
-                        canastas.emplace_back(std::to_string(ventaAnio.year));
-                        canasta = &canastas.back();
-                    } else {
-                        canasta = &(*it);
-                    }
+    for (size_t indice = 0; indice < mapa.size(); ++indice) {
+        const ProductoMapa& producto = mapa[indice];
+        for (int desplazamiento = 0; desplazamiento < ventas.anios(); ++desplazamiento) {
+            // Verificar si todos los meses tienen ventas
+            if (ventas.mascara(indice, desplazamiento) != CuboVentas::TODOS_LOS_MESES) {
+                continue;
+            }
+
+            // Buscar o crear la canasta para este año
+            if (canastaPorAnio[desplazamiento] < 0) {
+                canastaPorAnio[desplazamiento] = static_cast<int>(canastas.size());
+                canastas.emplace_back(ventas.primerAnio() + desplazamiento);
+            }
+            Canasta* canasta = &canastas[canastaPorAnio[desplazamiento]];
 
-                    // Agregar nombre e ID a la canasta
-                    canasta->agregarNombre(producto.nombres[0]); // Asumiendo que usamos el primer nombre
-                    canasta->agregarId(producto.id);
+            // Agregar nombre e ID a la canasta
+            canasta->agregarNombre(producto.nombres.dominante()); // El nombre más usado por el producto
+            canasta->agregarId(producto.id);
 
-                    // Calcular y sumar precios para cada mes
-                    for (int mes = 0; mes < 12; ++mes) {
-                        const auto& ventaMes = ventaAnio.ventasEnAnio[mes];
-                        if (ventaMes.sumatoriaCantidades > 0) {
-                            double precioUnitario = ventaMes.sumatoriaMontos / ventaMes.sumatoriaCantidades;
-                            canasta->precios[mes] += precioUnitario;
-                        }
-                    }
+            // Calcular y sumar precios para cada mes
+            const int64_t* cantidades = ventas.cantidadesDe(indice, desplazamiento);
+            for (int mes = 0; mes < 12; ++mes) {
+                if (cantidades[mes] > 0) {
+                    double precioUnitario = ventas.monto(indice, desplazamiento, mes) / cantidades[mes];
+                    canasta->precios[mes] += precioUnitario;
                 }
             }
         }
     }
 }
+// Arma las canastas de cada tienda y año: entran los productos que esa tienda
+// vendió en los 12 meses. Quedan ordenadas por tienda y año.
+void procesarCanastasPorTienda(const MapaProductos& mapa, std::vector<Canasta>& canastas) {
+    const VentasDispersas* tiendas = mapa.ventasPorTienda();
+    if (!tiendas) {
+        return;
+    }
+    std::map<std::pair<int, int>, Canasta> porTiendaYAnio;
+    for (size_t fila = 0; fila < tiendas->size(); ++fila) {
+        if (tiendas->mascara(fila) != CuboVentas::TODOS_LOS_MESES) {
+            continue;
+        }
+        const VentasDispersas::Clave& clave = tiendas->clave(fila);
+        const ProductoMapa& producto = mapa[clave.producto];
+        Canasta& canasta = porTiendaYAnio.try_emplace({ clave.tienda, clave.anio }, clave.anio, clave.tienda).first->second;
+        canasta.agregarNombre(producto.nombres.dominante());
+        canasta.agregarId(producto.id);
+
+        const int64_t* cantidades = tiendas->cantidadesDe(fila);
+        for (int mes = 0; mes < 12; ++mes) {
+            if (cantidades[mes] > 0) {
+                canasta.precios[mes] += tiendas->monto(fila, mes) / cantidades[mes];
+            }
+        }
+    }
+    for (auto& [clave, canasta] : porTiendaYAnio) {
+        canastas.push_back(std::move(canasta));
+    }
+}
+
+// Guarda los precios mensuales de las canastas por tienda en canastas_tiendas.txt
+void guardarCanastasPorTienda(const std::vector<Canasta>& canastas) {
+    std::ofstream archivo("canastas_tiendas.txt");
+    if (!archivo.is_open()) {
+        std::cout << "Error al abrir el archivo canastas_tiendas.txt." << std::endl;
+        return;
+    }
+    for (const auto& canasta : canastas) {
+        archivo << "Tienda " << canasta.tienda << ", año " << canasta.anio << " (" << canasta.ids.size() << " productos)" << std::endl;
+        archivo << "-----------------------------------" << std::endl;
+        for (int i = 0; i < 12; ++i) {
+            archivo << "Mes " << (i + 1) << ":\t| " << std::fixed << std::setprecision(2) << canasta.precios[i] << std::endl;
+        }
+        archivo << "-----------------------------------" << std::endl << std::endl;
+    }
+    std::cout << "Canastas por tienda guardadas en canastas_tiendas.txt." << std::endl;
+}
+
 // Función para calcular y guardar la inflación en un archivo de texto
 void calcularYGuardarInflacion(const std::vector<double>& preciosPeru, const std::vector<double>& tipoCambioPEN_CLP) {
     // Verificar que los vectores tengan la misma longitud (12 meses)
@@ -558,52 +3062,235 @@ void calcularYGuardarInflacion(const std::vector<double>& preciosPeru, const std
     }
 }
 
+// Lee un mes AAAA-MM de la línea de comandos como anio * 12 + mes - 1
+bool leerMesOpcion(std::string_view texto, int& mes) {
+    int anio = 0, numeroMes = 0;
+    const char* fin = texto.data() + texto.size();
+    auto resultado = std::from_chars(texto.data(), fin, anio);
+    if (resultado.ec != std::errc() || resultado.ptr == fin || *resultado.ptr != '-') {
+        return false;
+    }
+    resultado = std::from_chars(resultado.ptr + 1, fin, numeroMes);
+    if (resultado.ec != std::errc() || resultado.ptr != fin || numeroMes < 1 || numeroMes > 12
+        || anio < ANIO_MINIMO || anio > ANIO_MAXIMO) {
+        return false;
+    }
+    mes = anio * 12 + numeroMes - 1;
+    return true;
+}
 
 int main(int argc, char* argv[]) {
-    MapaProductos productos;//mapa completo todos los registros
-    MapaProductos canastaMap;//solo productos que pertenecen a la canasta
+    PoolSimbolos simbolos;//textos internados de ids y nombres de productos
     std::vector<Canasta> misCanastas;//vector con los datos importantes de canastas
     const int TAMANO_BLOQUE = 100000;//bloque para lectura csv
-    Cola cola_bloques;//cola para bloques
-    int cantidadBloques = 0;//sin usar, es para procesar mas de un bloque a la vez
+    int profundidadPrefetch = 2;//bloques que el lector puede adelantarse al procesamiento
+    int hilos = omp_get_max_threads();//hilos que convierten bloques en paralelo; cada uno guarda un mapa parcial
+    //de su bloque (productos del bloque por sus años, más sus filas por tienda o por día), así que la memoria crece con --hilos
+    int cantidadBloques = 0;//bloques leidos por el hilo lector
     int agrupar = 0;//contador para imprimir bloques leidos
     std::vector<int> AñosCanastas; //contiene los años para los que existe una canasta
     std::vector<double> PreciosCanasta;//contiene los 12 precios de la canasta para un año, se reutiliza
     std::vector<double> paridadAño(12, 0.0);//contiene la paridad de los 12 meses del año, se reutiliza
     std::vector<int> diasMes(12, 0);
     
+    if (argc >= 2 && std::string(argv[1]) == "indice") {
+        IndiceMeses indice;
+        ClaveCsv clave;
+        if (!obtenerClaveCsv("pd.csv", clave) || !indice.construir("pd.csv") || !indice.guardar("pd.csv", clave)) {
+            std::cout << "No se pudo crear " << nombreIndice("pd.csv") << "." << std::endl;
+            return 1;
+        }
+        std::cout << "Índice guardado en " << nombreIndice("pd.csv") << " (" << indice.size() << " zonas)." << std::endl;
+        return 0;
+    }
     if (argc < 2) {
-        std::cout << "Uso: " << argv[0] << " <nombre_archivo_excel>" << std::endl;
+        std::cout << "Uso: " << argv[0] << " indice" << std::endl;
+        std::cout << "     " << argv[0] << " <nombre_archivo_excel> [--sin-mmap] [--prefetch N] [--hilos N] [--punto-fijo] [--por-tienda] [--diario] [--sin-cache] [--sin-incremental] [--desde AAAA-MM] [--hasta AAAA-MM] [--ordenado] [--sin-indice]" << std::endl;
         return 1;
     }
     std::string nombreArchivo = argv[1];
+    bool usarMapeo = true;//mapear pd.csv en memoria si es un archivo regular
+    OpcionesAgregacion opciones;//punto fijo, por tienda, por día
+    bool usarCache = true;//leer y escribir pd.csv.cache con los registros ya convertidos
+    bool incremental = true;//retomar desde pd.csv.estado y procesar sólo lo agregado al final
+    bool cortarOrdenado = false;//pd.csv está ordenado por fecha: dejar de leer al pasar de --hasta
+    bool usarIndice = true;//con filtro de fechas, leer sólo las zonas de pd.csv.indice con esos meses
+    for (int i = 2; i < argc; ++i) {
+        std::string opcion = argv[i];
+        if (opcion == "--sin-mmap") {
+            usarMapeo = false;
+        } else if (opcion == "--prefetch" && i + 1 < argc) {
+            profundidadPrefetch = std::max(1, std::atoi(argv[++i]));
+        } else if (opcion == "--hilos" && i + 1 < argc) {
+            hilos = std::max(1, std::atoi(argv[++i]));
+        } else if (opcion == "--punto-fijo") {
+            opciones.puntoFijo = true;
+        } else if (opcion == "--por-tienda") {
+            opciones.porTienda = true;
+        } else if (opcion == "--diario") {
+            opciones.diario = true;
+        } else if (opcion == "--sin-cache") {
+            usarCache = false;
+        } else if (opcion == "--sin-incremental") {
+            incremental = false;
+        } else if (opcion == "--ordenado") {
+            cortarOrdenado = true;
+        } else if (opcion == "--sin-indice") {
+            usarIndice = false;
+        } else if ((opcion == "--desde" || opcion == "--hasta") && i + 1 < argc) {
+            if (!leerMesOpcion(argv[++i], opcion == "--desde" ? opciones.mesDesde : opciones.mesHasta)) {
+                std::cout << "Mes inválido para " << opcion << ": " << argv[i] << " (se espera AAAA-MM)" << std::endl;
+                return 1;
+            }
+        }
+    }
+    // El estado guardado tiene los totales de todas las fechas; con filtro no se
+    // retoma ni se guarda. Tampoco si pd.csv no es un archivo regular (una FIFO)
+    incremental = incremental && !opciones.filtraFechas() && esArchivoRegular("pd.csv");
+    MapaProductos productos(opciones);//mapa completo todos los registros
     
     
-    std::streampos posicion_actual = 0; // Variable para almacenar la posición actual en el archivo
-    descartarPrimeraLinea("pd.csv", posicion_actual);
+    // Si hay un estado guardado de una versión anterior de pd.csv se parte de
+    // él y se leen sólo los registros agregados desde entonces. Si no, y la
+    // caché corresponde a este pd.csv, los bloques salen de ella ya
+    // convertidos; si tampoco, se lee el CSV y se escribe la caché para la próxima vez
+    LectorCache cache;
+    std::unique_ptr<LectorBloques> lector;
+    std::unique_ptr<EscritorCache> escritor;
+    ClaveCsv claveCsv;
+    uint64_t desplazamientoEstado = 0;
+    if (incremental && cargarEstado("pd.csv", opciones, simbolos, productos, desplazamientoEstado)) {
+        lector = std::make_unique<LectorBloques>("pd.csv", usarMapeo);
+        lector->saltarA(desplazamientoEstado);
+        lector->dividirEnTramos(TAMANO_TRAMO);
+    } else if (!usarCache || !cache.abrir("pd.csv", opciones)) {
+        lector = std::make_unique<LectorBloques>("pd.csv", usarMapeo); // Una única fuente abierta para toda la lectura
+        // Con filtro de fechas se leen sólo las zonas del índice que tienen esos
+        // meses; si no hay índice de este pd.csv, se arma ahora y queda guardado
+        IndiceMeses indice;
+        ClaveCsv claveIndice;
+        bool conIndice = false;
+        if (opciones.filtraFechas() && usarIndice && obtenerClaveCsv("pd.csv", claveIndice)) {
+            conIndice = indice.cargar("pd.csv", claveIndice);
+            if (!conIndice && indice.construir("pd.csv")) {
+                indice.guardar("pd.csv", claveIndice);
+                conIndice = true;
+            }
+        }
+        if (conIndice) {
+            lector->leerSoloRangos(indice.rangos(opciones));
+            // Las zonas ya son todas las que pueden tener esos meses, ordenado o
+            // no el archivo; cortar por orden sólo podría perder registros
+            cortarOrdenado = false;
+        } else {
+            lector->descartarPrimeraLinea();
+            lector->dividirEnTramos(TAMANO_TRAMO);
+        }
+        if (usarCache && !opciones.filtraFechas() && obtenerClaveCsv("pd.csv", claveCsv)) {
+            escritor = std::make_unique<EscritorCache>();
+        }
+    }
+    Cola cola_bloques(profundidadPrefetch);//cola para bloques
+    // Bloques ya procesados que vuelven al lector; caben todos los que pueden estar en circulación
+    Cola bloques_libres(profundidadPrefetch + hilos + 1);
+    // Con filtro de fechas y --ordenado, el primer bloque que pasa del último mes
+    // pedido es el último que se procesa. Sólo si el usuario lo pide: lo leído
+    // hasta ahí no dice nada del resto, y en un extracto que sólo crece por el
+    // final una corrección tardía con fecha vieja se perdería. Si lo leído ya
+    // viene desordenado, no se corta.
+    std::atomic<size_t> bloqueCorte{ SIZE_MAX };
+    bool enOrden = true;//todos los registros fusionados venían ordenados por fecha
+    int ultimoMesLeido = -1;
+
+    // El hilo lector llena los bloques siguientes mientras se procesa el actual
+    std::thread hiloLector([&lector, &cache, &opciones, &cola_bloques, &bloques_libres, &cantidadBloques, &bloqueCorte,
+                            TAMANO_BLOQUE] {
+        if (!lector) {
+            while (cache.quedanBloques()) {
+                cache.leerBloque(cola_bloques, bloques_libres, opciones);
+                cantidadBloques++;
+            }
+        }
+        while (lector && lector->quedanLineasPorLeer() && bloqueCorte.load() == SIZE_MAX) {
+            lector->leerCSV(cola_bloques, bloques_libres, TAMANO_BLOQUE);
+            cantidadBloques++;
+        }
+        cola_bloques.cerrar();
+    });
+
+    // Cada hilo convierte y acumula en su mapa parcial los bloques que saca de
+    // la cola; en su turno fusiona el parcial con el mapa completo
+    Turnos turnos;
+    #pragma omp parallel num_threads(hilos)
+    {
+        BloquePtr bloque;
+        Campos campos;
+        MapaProductos parcial(opciones);
+        PoolSimbolos simbolosParcial;
+        while (cola_bloques.pop(bloque)) {
+            // Los bloques posteriores al corte sólo pasan su turno; se vuelve a
+            // mirar en el turno porque el corte puede decidirse mientras se convierte
+            if (bloque->numero <= bloqueCorte.load()) {
+                convertirBloque(*bloque, campos, opciones);
+                parcial.clear();
+                simbolosParcial.clear();
+                procesarBloque(*bloque, parcial, simbolosParcial);
+            }
 
-    while (quedanLineasPorLeer("pd.csv", posicion_actual)) {
-        leerCSV("pd.csv", cola_bloques, TAMANO_BLOQUE, posicion_actual);
-        cantidadBloques++;
-        agrupar++;
+            turnos.esperar(bloque->numero);
+            if (bloque->numero > bloqueCorte.load()) {
+                turnos.avanzar();
+                bloques_libres.intentarPush(bloque);
+                continue;
+            }
+            agrupar++;
 
-        if (agrupar == 10) {
-            //std::cout << "Bloques leídos hasta ahora: " << cantidadBloques << std::endl;
-            agrupar = 0; // Reiniciar el contador
-            //if(cantidadBloques>500){imprimirMapa(productos);}
-        }
+            if (agrupar == 10) {
+                //std::cout << "Bloques leídos hasta ahora: " << cantidadBloques << std::endl;
+                agrupar = 0; // Reiniciar el contador
+                //if(cantidadBloques>500){imprimirMapa(productos, simbolos);}
+            }
 
-        Bloque bloque;
-        if (!cola_bloques.pop(bloque)) {
-            std::cout << "Se han procesado todas las líneas del archivo." << std::endl;
-            break;
+            reportarErrores(*bloque);
+            if (escritor) {
+                escritor->agregarBloque(*bloque, opciones.puntoFijo);
+            }
+            fusionarParcial(productos, simbolos, parcial, simbolosParcial);
+            if (lector && cortarOrdenado && opciones.filtraFechas()) {
+                enOrden = enOrden && bloque->enOrden && bloque->primerMes >= ultimoMesLeido;
+                ultimoMesLeido = bloque->ultimoMes;
+                if (enOrden && ultimoMesLeido > opciones.mesHasta) {
+                    bloqueCorte = bloque->numero;
+                    std::cout << "--ordenado: se deja de leer pd.csv después de "
+                              << ultimoMesLeido / 12 << "-" << std::setw(2) << std::setfill('0') << ultimoMesLeido % 12 + 1
+                              << std::setfill(' ') << "." << std::endl;
+                }
+            }
+            turnos.avanzar();
+            bloques_libres.intentarPush(bloque); // Si no cabe se libera con el próximo pop
         }
-        procesarBloque(bloque, productos, canastaMap);
     }
-    procesarMapaYCanastas(canastaMap, misCanastas);
+    hiloLector.join();
+    if (escritor && !escritor->guardar("pd.csv", claveCsv, opciones)) {
+        std::cout << "No se pudo guardar " << nombreCache("pd.csv") << "." << std::endl;
+    }
+    if (incremental) {
+        uint64_t agregados = lector ? uint64_t(lector->posicion()) : cache.tamanoCsv();
+        guardarEstado("pd.csv", agregados, opciones, simbolos, productos);
+    }
+    // La pertenencia a la canasta se decide una sola vez, con los totales completos
+    procesarMapaYCanastas(productos, misCanastas);
+    if (opciones.porTienda) {
+        std::vector<Canasta> canastasTiendas;
+        procesarCanastasPorTienda(productos, canastasTiendas);
+        guardarCanastasPorTienda(canastasTiendas);
+    }
+    if (opciones.diario) {
+        guardarResumenDiario(productos, simbolos);
+    }
     // guardar años canastas
     for (const auto& canasta : misCanastas) {
-        AñosCanastas.push_back(std::stoi(canasta.anio));
+        AñosCanastas.push_back(canasta.anio);
     }
     //ordenar años
     std::sort(AñosCanastas.begin(), AñosCanastas.end());
@@ -623,7 +3310,7 @@ int main(int argc, char* argv[]) {
                         paridadAño[i]=0.0;
                     }
                     for (const auto& canasta : misCanastas) {
-                        if (value == std::stoi(canasta.anio)) {
+                        if (value == canasta.anio) {
                             // Cargar precios a un vector
                             PreciosCanasta.clear();
                             for (int i = 0; i < 12; ++i) {
@@ -631,7 +3318,7 @@ int main(int argc, char* argv[]) {
                             }
                             
                             // Calcular inflación para este año
-                            int yearObjetivo = std::stoi(canasta.anio);
+                            int yearObjetivo = canasta.anio;
                             //paridadAño.clear();
                             double fechaeXl ;
                             double precioeXl;
@@ -649,6 +3336,10 @@ int main(int argc, char* argv[]) {
                             for(int i = 0; i <= 11; ++i){
                                 diasMes[i]=0;
                             }
+                            // Por día, cada paridad se pondera con lo que vendió la canasta ese día
+                            std::vector<double> pesosDia = pesosDiariosCanasta(productos, canasta);
+                            std::vector<double> paridadPonderada(12, 0.0);
+                            std::vector<double> pesosMes(12, 0.0);
                             for (int row = inicio; row <= fin; row+=5) {
                                 //CellType cellType = sheet->cellType(row, col);
                                 int year, month, day;
@@ -663,11 +3354,19 @@ int main(int argc, char* argv[]) {
                                     //std::cout << "aaa"<< precioeXl << " aaa";
                                     paridadAño[month-1]+=precioeXl;
                                     diasMes[month-1]=diasMes[month-1]+1;
+                                    if (!pesosDia.empty()) {
+                                        double peso = pesosDia[diaDelAnio(month, day)];
+                                        paridadPonderada[month-1] += precioeXl * peso;
+                                        pesosMes[month-1] += peso;
+                                    }
                                 }
                             }
                             
                             for(int i = 0; i <= 11; ++i){
                                 paridadAño[i]=paridadAño[i]/diasMes[i];
+                                if (pesosMes[i] > 0.0) {
+                                    paridadAño[i] = paridadPonderada[i] / pesosMes[i]; // Si ningún día leído tuvo ventas queda el promedio simple
+                                }
                             }
                             calcularYGuardarInflacion(PreciosCanasta, paridadAño);
 